@@ -38,15 +38,25 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <glob.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
 
 #ifdef __linux__ // {
   #include <sys/inotify.h>
   #include <linux/limits.h>
   #include <linux/types.h>
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
   #define NOTIFY_INIT  inotify_init()
   #define EVENT_SIZE   (sizeof (struct inotify_event))
   #define BUF_LEN      (1024 * (EVENT_SIZE + 16))
@@ -59,24 +69,48 @@
 #include "mongoose/mongoose.h"
 #include "cjson/cJSON.h"
 
+// Static tracepoints under the "apophnia" provider, for perf and bpftrace:
+//   bpftrace -e 'usdt:./apophnia:apophnia:request__done { ... }'
+// Each is a nop until something attaches to it.  The makefile turns them
+// on when sys/sdt.h is there.
+#ifdef HAVE_SDT // {
+  #include <sys/sdt.h>
+  #define PROBE1(name, a)       DTRACE_PROBE1(apophnia, name, a)
+  #define PROBE2(name, a, b)    DTRACE_PROBE2(apophnia, name, a, b)
+  #define PROBE3(name, a, b, c) DTRACE_PROBE3(apophnia, name, a, b, c)
+#else
+  #define PROBE1(name, a)
+  #define PROBE2(name, a, b)
+  #define PROBE3(name, a, b, c)
+#endif // }
+
 #define CONFIG        "apophnia.conf"
 #define BUFSIZE       16384
 #define MAX_DIRECTIVES 16
+#define SRCSET_MAX    16
+#define MEMBER_THREADS 16
+#define PREGEN_MAX    64
 #define ASSERT_CHAR(ptr, chr) ((ptr[0] == chr) && ptr++)
 
 cJSON *g_config;
 
+struct mg_context *g_ctx;
+
 jmp_buf g_jump_buf;
 
 int 
   g_notify_handle, 
-  g_notify,
-  g_stat_check = 0;
+  // where derivatives live; AT_FDCWD (img_root) unless cache_root is set
+  g_cache_fd = AT_FDCWD,
+  g_tmp_seq = 0;
 
 struct {
   char 
     img_root[PATH_MAX],
+    cache_root[PATH_MAX],
+    index_file[PATH_MAX],
     badfile_fd[PATH_MAX],
+    overload_image[PATH_MAX],
     proportion,
     b_disk,
     true_bmp;
@@ -84,9 +118,31 @@ struct {
   int 
     port,
     max_age,
+    index_slots,
+    swr,
+    degrade,
+    degrade_max_age,
+    bg_threads,
+    pack_max,
+    pack_size,
+    overload_queue,
+    overload_transforms,
+    overload_latency,
+    retry_after,
+    access_log,
+    log_sample,
     log_fd,
-    log_level;
-} g_opts;
+    log_level,
+    slow_ms,
+    slow_rate,
+    slow_fd,
+    perf_counters,
+    srcset[SRCSET_MAX],
+    srcset_count,
+    grid_tiles,
+    pregen_top,
+    prefix_keep;
+} g_opts = { .log_fd = 1, .slow_fd = -1 };
 
 struct { 
   char
@@ -101,14 +157,38 @@ struct {
 } args[] = {
   { "port", "Mongoose Port", &g_opts.port, cJSON_Number },
   { "img_root", "Image Root", &g_opts.img_root, cJSON_String },
+  { "cache_root", "Cache Root", &g_opts.cache_root, cJSON_String },
+  { "index", "Index File", &g_opts.index_file, cJSON_String },
+  { "index_slots", "Index Slots", &g_opts.index_slots, cJSON_Number },
   { "proportion", "Proportion", &g_opts.proportion, cJSON_String },
   { "true_bmp", "True BMP", &g_opts.true_bmp, cJSON_Number },
   { "no_support", "Proportion", &g_opts.img_root, cJSON_String },
   { "log_level", "Log Level", &g_opts.log_level, cJSON_Number },
   { "log_file", "Log File", &g_opts.log_fd, cJSON_String },
+  { "log_sample", "Log Sample", &g_opts.log_sample, cJSON_Number },
+  { "access_log", "Access Log", &g_opts.access_log, cJSON_Number },
+  { "slow_ms", "Slow Threshold", &g_opts.slow_ms, cJSON_Number },
+  { "slow_rate", "Slow Rate", &g_opts.slow_rate, cJSON_Number },
+  { "slow_log", "Slow Log", &g_opts.slow_fd, cJSON_String },
+  { "perf_counters", "Perf Counters", &g_opts.perf_counters, cJSON_Number },
+  { "srcset", "Srcset Widths", &g_opts.srcset, cJSON_String },
+  { "grid_tiles", "Grid Tiles", &g_opts.grid_tiles, cJSON_Number },
+  { "pregen_top", "Pregenerated Recipes", &g_opts.pregen_top, cJSON_Number },
+  { "prefix_keep", "Keep Prefixes After", &g_opts.prefix_keep, cJSON_Number },
   { "disk", "Disk Write", &g_opts.b_disk, cJSON_Number },
   { "404", "404 image", &g_opts.badfile_fd, cJSON_String },
   { "max_age", "Cache Max-Age", &g_opts.max_age, cJSON_Number },
+  { "stale_while_revalidate", "Max Staleness", &g_opts.swr, cJSON_Number },
+  { "background_threads", "Background Threads", &g_opts.bg_threads, cJSON_Number },
+  { "pack_max", "Pack Max", &g_opts.pack_max, cJSON_Number },
+  { "pack_size", "Pack Size", &g_opts.pack_size, cJSON_Number },
+  { "overload_queue", "Overload Queue", &g_opts.overload_queue, cJSON_Number },
+  { "overload_transforms", "Overload Transforms", &g_opts.overload_transforms, cJSON_Number },
+  { "overload_latency", "Overload Latency", &g_opts.overload_latency, cJSON_Number },
+  { "overload_image", "Overload Image", &g_opts.overload_image, cJSON_String },
+  { "retry_after", "Retry-After", &g_opts.retry_after, cJSON_Number },
+  { "degrade_tolerance", "Degrade Tolerance", &g_opts.degrade, cJSON_Number },
+  { "degrade_max_age", "Degraded Max-Age", &g_opts.degrade_max_age, cJSON_Number },
   { 0, 0, 0, 0 }
 };
 
@@ -128,6 +208,10 @@ const char *proportion[] = {
 #define D_OFFSET  'o'
 #define D_QUALITY  'q'
 
+// Only ever planned, never asked for: a resize and the crop after it, see
+// image_region
+#define D_REGION  'R'
+
 const struct {
   char 
     pfix,
@@ -158,47 +242,294 @@ void (*plog1)(const char*t, ...);
 void (*plog2)(const char*t, ...);
 void (*plog3)(const char*t, ...);
 
-void log_real(const char*t, ...) {
-  va_list ap;
-  char *s;
+// Logging
+//
+// Each thread formats its lines into its own ring buffer, and a background
+// thread writes out whatever all the rings have, in one writev to log_fd.
+// Nothing on the request path takes a lock or makes a syscall; when a ring
+// is full the line is dropped and counted.  With log_sample set, only one
+// in that many level 2 and 3 lines and access records is kept.  Lines for
+// slow_log go through the same rings, starting with LOG_SLOW, which the
+// writer takes off and sends them there instead.
+#define LOG_RING      65536
+#ifndef IOV_MAX
+#define IOV_MAX       1024
+#endif
+#define LOG_LINE      1024
+#define LOG_SLOW      '\001'
+
+struct log_ring {
+  char buf[LOG_RING];
+
+  // free running; head is only moved by the owner, tail by the writer
+  volatile uint32_t 
+    head,
+    tail;
+
+  uint32_t sample;
+
+  volatile int64_t dropped;
+  int64_t reported;
+
+  // what the writer has in hand, to hand back once it's written
+  uint32_t taken;
+
+  struct log_ring *next;
+};
+
+struct log_ring *g_log = 0;
+pthread_mutex_t g_log_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct log_ring *t_log = 0;
+
+struct log_ring *log_local() {
+  static uint32_t rings = 0;
+
+  if(!t_log) {
+    t_log = (struct log_ring*) calloc(1, sizeof(struct log_ring));
+    pthread_mutex_lock(&g_log_lock);
+    // stagger the sampling so that not every thread keeps its first line
+    t_log->sample = rings++;
+    t_log->next = g_log;
+    g_log = t_log;
+    pthread_mutex_unlock(&g_log_lock);
+  }
+  return t_log;
+}
+
+void log_put(const char *line, int len) {
+  struct log_ring *ring = log_local();
+  uint32_t 
+    off = ring->head % LOG_RING,
+    first = len;
+
+  if(LOG_RING - (ring->head - ring->tail) < (uint32_t) len) {
+    ring->dropped++;
+    return;
+  }
+
+  if(first > LOG_RING - off) {
+    first = LOG_RING - off;
+  }
+  memcpy(ring->buf + off, line, first);
+  memcpy(ring->buf, line + first, len - first);
+
+  __sync_synchronize();
+  ring->head += len;
+}
+
+// Whether this line makes the log_sample cut
+int log_keep() {
+  return g_opts.log_sample <= 1 || !(log_local()->sample++ % g_opts.log_sample);
+}
+
+// Starts a line with the time, the way they all start
+int log_stamp(char *line) {
   struct timeval tp;
-  va_start(ap, t);
 
   gettimeofday(&tp, 0);
-  printf("[ %d.%06d ] ", (int) tp.tv_sec, (int) tp.tv_usec );
+  return sprintf(line, "[ %d.%06d ] ", (int) tp.tv_sec, (int) tp.tv_usec);
+}
 
-  while(*t) {
+// Adds to a line that's kept to LOG_LINE - 2 bytes, leaving room for the
+// newline and LOG_SLOW.  Returns its new length.
+int log_append(char *line, int len, const char *fmt, ...) {
+  va_list ap;
+
+  if(len < LOG_LINE - 2) {
+    va_start(ap, fmt);
+    len += vsnprintf(line + len, LOG_LINE - 1 - len, fmt, ap);
+    va_end(ap);
+  }
+  return len < LOG_LINE - 2 ? len : LOG_LINE - 2;
+}
+
+void log_vreal(const char*t, va_list ap) {
+  char 
+    line[LOG_LINE],
+    *s;
+
+  int len = log_stamp(line);
+
+  while(*t && len < LOG_LINE - 32) {
     if(*t == '%') {
       t++;
       if(*t == 's') {
         s = (char*) va_arg(ap, char *);
-        if(!s) {
-          printf("<null>");
-        } else {
-          printf("%s", s);
+        len += snprintf(line + len, LOG_LINE - 32 - len, "%s", s ? s : "<null>");
+        if(len > LOG_LINE - 32) {
+          len = LOG_LINE - 32;
         }
       } else if(*t == 'd') {
-        printf("%d", (int) va_arg(ap, int));
+        len += sprintf(line + len, "%d", (int) va_arg(ap, int));
       }
     } else {
-      putchar(t[0]);
+      line[len++] = t[0];
     }
 
     t++;
   }
 
+  line[len++] = '\n';
+  log_put(line, len);
+}
+
+void log_real(const char*t, ...) {
+  va_list ap;
+
+  va_start(ap, t);
+  log_vreal(t, ap);
+  va_end(ap);
+}
+
+void log_sampled(const char*t, ...) {
+  va_list ap;
+
+  if(!log_keep()) {
+    return;
+  }
+
+  va_start(ap, t);
+  log_vreal(t, ap);
   va_end(ap);
-  printf ("\n");
 }
 
 void log_fake(const char*t, ...) {
   return;
 }
 
+int64_t log_dropped() {
+  struct log_ring *ring;
+  int64_t count = 0;
+
+  pthread_mutex_lock(&g_log_lock);
+  for(ring = g_log; ring; ring = ring->next) {
+    count += ring->dropped;
+  }
+  pthread_mutex_unlock(&g_log_lock);
+  return count;
+}
+
+// The pieces of the rings going to one descriptor
+struct log_out {
+  struct iovec iov[IOV_MAX];
+  int count;
+};
+
+// Adds len bytes at p to out, onto the last piece if they follow it
+void log_add(struct log_out *out, char *p, uint32_t len) {
+  struct iovec *last = out->count ? &out->iov[out->count - 1] : 0;
+
+  if(!len) {
+    return;
+  }
+  if(last && (char*) last->iov_base + last->iov_len == p) {
+    last->iov_len += len;
+  } else {
+    out->iov[out->count].iov_base = p;
+    out->iov[out->count++].iov_len = len;
+  }
+}
+
+// Writes out everything the rings have, a whole line at a time so the
+// slow ones can go to slow_log
+void log_drain() {
+  static struct log_out 
+    to_log,
+    to_slow;
+
+  struct log_ring *ring;
+  struct log_out *out;
+  char 
+    note[64],
+    *nl;
+
+  uint32_t 
+    head,
+    pos,
+    off,
+    used,
+    first,
+    len,
+    skip;
+
+  int ix;
+  int64_t dropped = 0;
+
+  pthread_mutex_lock(&g_log_lock);
+  to_log.count = to_slow.count = 0;
+  for(ring = g_log; ring; ring = ring->next) {
+    head = ring->head;
+    __sync_synchronize();
+
+    // a line takes at most two pieces, as it may wrap
+    for(pos = ring->tail; pos != head && to_log.count < IOV_MAX - 3 && to_slow.count < IOV_MAX - 2; pos += len) {
+      off = pos % LOG_RING;
+      used = head - pos;
+      first = used < LOG_RING - off ? used : LOG_RING - off;
+      if((nl = (char*) memchr(ring->buf + off, '\n', first))) {
+        len = nl - ring->buf - off + 1;
+      } else if((nl = (char*) memchr(ring->buf, '\n', used - first))) {
+        len = first + nl - ring->buf + 1;
+      } else {
+        len = used;
+      }
+
+      skip = ring->buf[off] == LOG_SLOW;
+      out = skip && g_opts.slow_fd != -1 ? &to_slow : &to_log;
+      if(off + len <= LOG_RING) {
+        log_add(out, ring->buf + off + skip, len - skip);
+      } else {
+        log_add(out, ring->buf + off + skip, LOG_RING - off - skip);
+        log_add(out, ring->buf, off + len - LOG_RING);
+      }
+    }
+    ring->taken = pos - ring->tail;
+
+    dropped += ring->dropped - ring->reported;
+    ring->reported = ring->dropped;
+  }
+
+  if(dropped) {
+    ix = log_stamp(note);
+    ix += sprintf(note + ix, "Dropped %d log lines\n", (int) dropped);
+    log_add(&to_log, note, ix);
+  }
+
+  // nothing to be done about a log that can't be written
+  if(to_log.count && writev(g_opts.log_fd, to_log.iov, to_log.count)) {
+  }
+  if(to_slow.count && writev(g_opts.slow_fd, to_slow.iov, to_slow.count)) {
+  }
+
+  // hand the space back
+  for(ring = g_log; ring; ring = ring->next) {
+    __sync_synchronize();
+    ring->tail += ring->taken;
+    ring->taken = 0;
+  }
+  pthread_mutex_unlock(&g_log_lock);
+}
+
+void *log_thread(void *arg) {
+  for(;;) {
+    usleep(20000);
+    log_drain();
+  }
+  return 0;
+}
+
+void log_start() {
+  pthread_t thread;
+
+  pthread_create(&thread, 0, log_thread, 0);
+  pthread_detach(thread);
+}
+
 void fatal(const char*t, ...) {
   va_list ap;
   char *s;
 
+  log_drain();
   printf ("Fatal: ");
 
   va_start(ap, t);
@@ -266,447 +597,4434 @@ char *itoa(int in) {
   return ptr;
 }
 
-void *do404(struct mg_connection *conn) {
-  static char *buffer = 0;
-  static int len = 0;
-
-  if(!buffer && g_opts.badfile_fd) {
-    int fd = 0, ret;
-    struct stat st;
-    char *ptr;
+// 64-bit FNV-1a
+uint64_t hash_str(const char *str) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
 
-    fd = open(g_opts.badfile_fd, O_RDONLY);
-    if(fd > 0) {
-      fstat(fd, &st);
-      len = st.st_size;
-      buffer = (char*)malloc(sizeof(char) * len);
-      ptr = buffer;
+  for(; *str; str++) {
+    hash ^= (unsigned char) *str;
+    hash *= 0x100000001b3ULL;
+  }
 
-      for(;;) {  
-        ret = read(fd, ptr, BUFSIZE);
+  return hash;
+}
 
-        if(!ret) {
-          break;
-        }
+// The canonical form of a request: no leading slashes and no empty (NOP)
+// directives, so myfile__q54.jpg and myfile_q54.jpg are the same recipe.
+void recipe_key(const char *name, char *key) {
+  while(*name == '/') { name++; }
 
-        ptr += ret;
-      }
-      close(fd);
+  for(; *name; name++) {
+    if(name[0] == '_' && (name[1] == '_' || name[1] == '.')) {
+      continue;
     }
+    *key++ = *name;
   }
+  *key = 0;
+}
 
-  mg_printf(conn, "%s", "HTTP/1.1 404 Not Found\n");
-  mg_printf(conn, "%s", "Content-Type: image/png\n");
-  if(len) {
-    mg_printf(conn, "Content-Length: %d\n", len);
-  }
-  mg_printf(conn, "%s", "Connection: Close\r\n\r\n");
+// Where a derivative lives relative to g_cache_fd.  Without a cache_root
+// this is the request itself, next to the original.  Otherwise it is
+// fanned out over two levels of 256 directories by the hash of the recipe
+// key, ab/cd/abcd0123456789ef.jpg, so the path is computed and never
+// searched for.
+void cache_path(const char *name, char *path) {
+  char 
+    key[PATH_MAX],
+    *ext;
 
-  if(len) {
-    mg_write(conn, buffer, len);
+  uint64_t hash;
+
+  if(g_cache_fd == AT_FDCWD) {
+    strcpy(path, name);
+    return;
   }
 
-  return (void*)1;
-}
+  recipe_key(name, key);
+  hash = hash_str(key);
 
-char check_for_change(int fd, char*ptr) {
-  size_t 
-    sz,
-    ext_len;
+  ext = strrchr(key, '.');
+  if(!ext || strchr(ext, '/')) {
+    ext = "";
+  }
 
-  char 
-    *pFlat,
-    *pFile,
-    *end = ptr + strlen(ptr),
-    *ext;
+  sprintf(path, "%02x/%02x/%016llx%s", 
+    (int) (hash >> 56), 
+    (int) (hash >> 48) & 0xff, 
+    (unsigned long long) hash,
+    ext
+  );
+}
 
-  struct 
-    stat   
-    original,
-    converted,
-    test;
+int cache_open(const char *name) {
+  char path[PATH_MAX];
 
-  short 
-    ctr, 
-    f_sz = end - ptr;
+  int fd;
 
-  pFlat = (char*)(malloc(f_sz * sizeof(char) * PATH_MAX * MAX_DIRECTIVES));
+  cache_path(name, path);
+  fd = openat(g_cache_fd, path, O_RDONLY);
+  PROBE2(open, name, fd);
+  return fd;
+}
 
-  // find the extension
-  while(*end != '.' && end > ptr) { end --; }
-  ext = end;
-  ext_len = strlen(ext);
-  
-  fstat(fd, &converted);
+// Creates the ab/ and ab/cd/ levels above a cache path
+void cache_mkdir(const char *path) {
+  char dir[8] = {0};
 
-  for(ctr = 0; ctr < MAX_DIRECTIVES; ctr++) {
-    pFile = pFlat + (ctr * f_sz);
+  memcpy(dir, path, 5);
+  dir[2] = 0;
+  mkdirat(g_cache_fd, dir, 0755);
+  dir[2] = '/';
+  mkdirat(g_cache_fd, dir, 0755);
+}
 
-    // truncate the directive
-    while(*end != '_' && end > ptr) { end --; }
-    if(end == ptr) {
-      break;
-    }
-    // copy up to this point in the name
-    sz = end - ptr;
-    memcpy(pFile, ptr, sz);
-    memcpy(pFile + sz, ext, ext_len);
-    pFile[sz + ext_len] = 0;
+// Writes a derivative to a temporary file next to its final name and
+// renames it into place, so readers see either nothing or the whole file.
+// st gets the file's stat.
+int cache_commit(const char *name, const unsigned char *data, size_t sz, struct stat *st) {
+  char 
+    path[PATH_MAX],
+    tmp[PATH_MAX + 32];
 
-    fflush(0);
+  int 
+    ret,
+    fd;
 
-    if(stat(pFile, &test)) { 
-      break;
-    } else {
-      memcpy(&original, &test, sizeof(struct stat));
-    }
+  cache_path(name, path);
+  snprintf(tmp, sizeof(tmp), "%s.%d.%d.tmp", path, 
+    (int) getpid(), 
+    __sync_fetch_and_add(&g_tmp_seq, 1)
+  );
 
-    end --;
+  fd = openat(g_cache_fd, tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if(fd == -1 && errno == ENOENT && g_cache_fd != AT_FDCWD) {
+    cache_mkdir(path);
+    fd = openat(g_cache_fd, tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
   }
 
-  // we found the base, it's the stat of test
-  if(  test.st_mtime > converted.st_mtime || 
-    test.st_ctime > converted.st_ctime
-  ) {
-    plog3("Found out of date files... removing");
-    
-    // invalidate the incoming image
-    unlink(ptr);
-    plog3(ptr);
+  if(fd == -1) {
+    plog1("Couldn't create %s", tmp);
+    return 0;
+  }
 
-    // invalidate the chained images
-    for( ctr -= 2; ctr >= 0; ctr--) {
-      pFile = pFlat + (ctr * f_sz);
-      plog3(pFile);
-      unlink(pFile);
+  while(sz > 0) {
+    ret = write(fd, data, sz);
+    if(ret <= 0) {
+      break;
     }
+    data += ret;
+    sz -= ret;
+  }
+  fstat(fd, st);
+  close(fd);
 
-    free(pFlat);
+  if(sz || renameat(g_cache_fd, tmp, g_cache_fd, path)) {
+    plog1("Couldn't write %s", path);
+    unlinkat(g_cache_fd, tmp, 0);
     return 0;
   }
 
-  free(pFlat);
-
+  plog1("Created %s", path);
   return 1;
 }
 
-int image_start(MagickWand *wand, int fd) {
-  MagickBooleanType stat;
-  FILE *fdesc = fdopen(fd, "rb");
+// Makes name a hard link to the original fname, for a recipe that leaves
+// it as it is.  Returns 0 if it can't be, as across filesystems.
+int cache_link(const char *fname, const char *name) {
+  char 
+    path[PATH_MAX],
+    tmp[PATH_MAX + 32];
 
-  stat = MagickReadImageFile(wand, fdesc);
-  if (stat == MagickFalse) {
-    return 0;
+  int ret;
+
+  cache_path(name, path);
+  snprintf(tmp, sizeof(tmp), "%s.%d.%d.tmp", path, 
+    (int) getpid(), 
+    __sync_fetch_and_add(&g_tmp_seq, 1)
+  );
+
+  ret = linkat(AT_FDCWD, fname, g_cache_fd, tmp, 0);
+  if(ret == -1 && errno == ENOENT && g_cache_fd != AT_FDCWD) {
+    cache_mkdir(path);
+    ret = linkat(AT_FDCWD, fname, g_cache_fd, tmp, 0);
   }
 
-  MagickResetIterator(wand);
+  if(ret == -1) {
+    return 0;
+  }
 
-  while (MagickNextImage(wand) != MagickFalse);
+  if(renameat(g_cache_fd, tmp, g_cache_fd, path)) {
+    unlinkat(g_cache_fd, tmp, 0);
+    return 0;
+  }
 
+  plog1("Linked %s to %s", path, fname);
   return 1;
 }
 
-unsigned char* image_end(MagickWand *wand, size_t *sz) {
-  return MagickGetImageBlob(wand, sz);
-}
-
-int image_offset(MagickWand *wand, char*ptr){
-  int 
-    offsetY, 
-    offsetX, 
-    height, 
-    width;
-
-  height = atoi_ptr(&ptr);
-  if(!ASSERT_CHAR(ptr, 'x')) {
-    plog0("%s\n", ptr);
-    return 0;
-  }
-  width = atoi_ptr(&ptr);
+// Stats
+//
+// Every thread counts into its own struct stats, without locks or atomics
+// on the request path, and show_stats adds them all up when asked.  Times
+// are in microseconds, in log-linear buckets: exact below 16, then 16 per
+// power of two, so within about 6%.
+#define ST_REQUEST    0
+#define ST_LOOKUP     1
+#define ST_DECODE     2
+#define ST_RESIZE     3
+#define ST_CROP       4
+#define ST_QUALITY    5
+#define ST_ENCODE     6
+#define ST_WRITE      7
+#define ST_SEND       8
+#define ST_COUNT      9
+
+#define C_HIT         0
+#define C_MISS        1
+#define C_STALE       2
+#define C_404         3
+#define C_COALESCED   4
+#define C_BYTES       5
+#define C_SLOW        6
+#define C_PREGEN      7
+#define C_PREFIX      8
+#define C_COUNT       9
+
+#define HIST_SUB      16
+#define HIST_BUCKETS  ((40 - 3) * HIST_SUB)
+
+const char *g_stage_names[] = {
+  "request", "lookup", "decode", "resize", "crop", "quality", "encode", "write", "send"
+};
 
-  offsetY = atoi_ptr(&ptr);
-  offsetX = atoi_ptr(&ptr);
+struct stats {
+  int64_t 
+    hist[ST_COUNT][HIST_BUCKETS],
+    sum[ST_COUNT],
+    max[ST_COUNT],
+    counter[C_COUNT];
 
-  return MagickCropImage(wand, width, height, offsetX, offsetY);
-}
+  struct stats *next;
+};
 
-int image_quality(MagickWand *wand, char*ptr) {
-  int quality = atoi(ptr);
+struct stats *g_stats = 0;
+pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct stats *t_stats = 0;
 
-  return MagickSetImageCompressionQuality(wand, quality);
-}
+// pixels of the originals that are decoded right now
+int64_t g_pixels = 0;
 
-int image_resize(MagickWand *wand, char*ptr) {
-  char *last;
+// what the request this thread is on did, for its access and slow records
+__thread struct {
+  int64_t 
+    stage[ST_COUNT],
+    bytes,
+    queued,
+    wand_peak;
 
   int 
-    height = -1, 
-    width = -1;
+    status,
+    width,
+    height,
+    steps_len;
 
-  for(last = ptr;;ptr++) {
-    if(ptr[0] >= '0' && ptr[0] <= '9') {
-      continue;
-    }
-    if(ptr[0] == 'x') {
-      ptr[0] = 0;
-      height = atoi(last);
-      ptr[0] = 'x';
-      last = ptr + 1;
-      continue;
-    }
-    if(ptr[0] <= 32) {
-      width = atoi(last);
-      if(height == -1) {
-        height = width;
-      }
-      ptr++;
-      break;
-    }
-  }
+  const char *outcome;
 
-  printf("%d\n", g_opts.proportion);
-  /*
-  if(g_opts.proportion ==
-  MagickLiquidRescaleImage
-  */
-  MagickResizeImage(
-    wand,
-    height,
-    width,
-    LanczosFilter,
-    1.0
-  );
+  // only filled in with slow_ms set: the original's format and each
+  // directive with its time, like "r200x100:1450,q80:3"
+  char 
+    format[16],
+    steps[256];
+} t_req;
 
-  return 1;
+int64_t now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void *show_image(
-    struct mg_connection *conn
-  ) {
+struct stats *stats_local() {
+  if(!t_stats) {
+    t_stats = (struct stats*) calloc(1, sizeof(struct stats));
+    pthread_mutex_lock(&g_stats_lock);
+    t_stats->next = g_stats;
+    g_stats = t_stats;
+    pthread_mutex_unlock(&g_stats_lock);
+  }
+  return t_stats;
+}
 
-  int 
-    ret,
-    fd = -1; 
+int hist_bucket(int64_t us) {
+  int msb;
 
-  const char* rfc1123fmt = "%a, %d %b %Y %H:%M:%S GMT";
-  const struct mg_request_info *request_info = mg_get_request_info(conn);
+  if(us < HIST_SUB) {
+    return us < 0 ? 0 : (int) us;
+  }
+  if(us >= (int64_t) 1 << 40) {
+    us = ((int64_t) 1 << 40) - 1;
+  }
+  msb = 63 - __builtin_clzll(us);
+  return (msb - 3) * HIST_SUB + (int) ((us >> (msb - 4)) & (HIST_SUB - 1));
+}
 
-  int formatOffset = 0;
+// the smallest value that lands in bucket ix
+int64_t hist_value(int ix) {
+  if(ix < HIST_SUB) {
+    return ix;
+  }
+  return (int64_t) (HIST_SUB + ix % HIST_SUB) << (ix / HIST_SUB - 1);
+}
 
-  char 
-    // index in the formatCheck for the fallback
-    formatIndex = -1,
-    fname[PATH_MAX] = {0},
-    butcher[PATH_MAX] = {0},
-    buf[BUFSIZE] = {0},
+void stat_time(int stage, int64_t us) {
+  struct stats *st = stats_local();
 
-    *commandList[MAX_DIRECTIVES] = {0}, 
-    **pCommand = commandList, 
-    **pTmp,
+  st->hist[stage][hist_bucket(us)]++;
+  st->sum[stage] += us;
+  t_req.stage[stage] += us;
+  if(us > st->max[stage]) {
+    st->max[stage] = us;
+  }
+}
 
-    *ptr, 
-    *last, 
-    *ext = 0,
-  
-    nowbuf[100] = {0},
-    modbuf[100] = {0},
-    expbuf[100] = {0};
+void stat_count(int counter, int64_t n) {
+  stats_local()->counter[counter] += n;
+}
 
-  unsigned char *image;
+char *slurp(const char *path, int *len) {
+  char 
+    *buffer = 0,
+    *ptr;
 
+  int fd = 0, ret;
   struct stat st;
 
-  size_t sz;
+  fd = open(path, O_RDONLY);
+  if(fd > 0) {
+    fstat(fd, &st);
+    *len = st.st_size;
+    buffer = (char*)malloc(sizeof(char) * *len);
+    ptr = buffer;
 
-  time_t 
-    now, 
-    mod, 
-    expires;
+    for(;;) {  
+      ret = read(fd, ptr, BUFSIZE);
+
+      if(ret <= 0) {
+        break;
+      }
+
+      ptr += ret;
+    }
+    close(fd);
+  }
+
+  return buffer;
+}
+
+void *do404(struct mg_connection *conn) {
+  static char *buffer = 0;
+  static int len = 0;
+
+  stat_count(C_404, 1);
+  t_req.status = 404;
+
+  if(!buffer && g_opts.badfile_fd[0]) {
+    buffer = slurp(g_opts.badfile_fd, &len);
+  }
+
+  // mongoose keeps the connection whatever this says, so the length is
+  // what tells a client the response is over
+  mg_printf(conn, "%s", "HTTP/1.1 404 Not Found\r\n");
+  mg_printf(conn, "%s", "Content-Type: image/png\r\n");
+  mg_printf(conn, "Content-Length: %d\r\n", len);
+  mg_printf(conn, "%s", "Connection: Close\r\n\r\n");
+
+  if(len) {
+    mg_write(conn, buffer, len);
+  }
+
+  return (void*)1;
+}
+
+// Turns a miss away while overloaded, with the overload_image if there is one
+void *do503(struct mg_connection *conn) {
+  static char *buffer = 0;
+  static int len = 0;
+
+  if(!buffer && g_opts.overload_image[0]) {
+    buffer = slurp(g_opts.overload_image, &len);
+  }
+
+  t_req.status = 503;
+  t_req.outcome = "SHED";
+  mg_printf(conn, "%s", "HTTP/1.1 503 Service Unavailable\r\n");
+  mg_printf(conn, "Retry-After: %d\r\n", g_opts.retry_after);
+  mg_printf(conn, "%s", "Cache-Control: no-store\r\n");
+  mg_printf(conn, "%s", "X-Cache: SHED\r\n");
+  if(len) {
+    mg_printf(conn, "%s", "Content-Type: image/png\r\n");
+  }
+  mg_printf(conn, "Content-Length: %d\r\n\r\n", len);
+
+  if(len) {
+    mg_write(conn, buffer, len);
+  }
+
+  return (void*)1;
+}
+
+// Background jobs
+//
+// A few threads that work through named jobs, most urgent first.  A name
+// is only ever queued or running once, so asking again for something
+// that's already coming is free.
+#define BG_NOW      0
+#define BG_LATER    1
+#define BG_LEVELS   2
+#define BG_BUCKETS  1024
+
+struct job {
+  void (*fn)(const char*);
+
+  struct job 
+    *next,
+    *hnext;
+
+  uint64_t hash;
+  char name[1];
+};
+
+struct {
+  struct job 
+    *head[BG_LEVELS],
+    *tail[BG_LEVELS],
+    *pending[BG_BUCKETS];
+
+  int count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} g_bg = { 
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER
+};
+
+int bg_submit(void (*fn)(const char*), const char *name, int prio) {
+  struct job *job;
+  uint64_t hash = hash_str(name);
+
+  pthread_mutex_lock(&g_bg.lock);
+  for(job = g_bg.pending[hash % BG_BUCKETS]; job; job = job->hnext) {
+    if(job->hash == hash && job->fn == fn && !strcmp(job->name, name)) {
+      pthread_mutex_unlock(&g_bg.lock);
+      return 0;
+    }
+  }
+
+  job = (struct job*) calloc(1, sizeof(struct job) + strlen(name));
+  strcpy(job->name, name);
+  job->fn = fn;
+  job->hash = hash;
+
+  job->hnext = g_bg.pending[hash % BG_BUCKETS];
+  g_bg.pending[hash % BG_BUCKETS] = job;
+
+  if(g_bg.tail[prio]) {
+    g_bg.tail[prio]->next = job;
+  } else {
+    g_bg.head[prio] = job;
+  }
+  g_bg.tail[prio] = job;
+  g_bg.count++;
+
+  pthread_cond_signal(&g_bg.cond);
+  pthread_mutex_unlock(&g_bg.lock);
+
+  return 1;
+}
+
+void *bg_thread(void *arg) {
+  struct job 
+    *job,
+    **pJob;
+
+  int prio;
+
+  for(;;) {
+    pthread_mutex_lock(&g_bg.lock);
+    while(!g_bg.count) {
+      pthread_cond_wait(&g_bg.cond, &g_bg.lock);
+    }
+
+    for(prio = 0; !g_bg.head[prio]; prio++);
+
+    job = g_bg.head[prio];
+    g_bg.head[prio] = job->next;
+    if(!job->next) {
+      g_bg.tail[prio] = 0;
+    }
+    g_bg.count--;
+    pthread_mutex_unlock(&g_bg.lock);
+
+    job->fn(job->name);
+
+    pthread_mutex_lock(&g_bg.lock);
+    for(pJob = &g_bg.pending[job->hash % BG_BUCKETS]; *pJob != job; pJob = &(*pJob)->hnext);
+    *pJob = job->hnext;
+    pthread_mutex_unlock(&g_bg.lock);
+
+    free(job);
+  }
+
+  return 0;
+}
+
+void bg_start() {
+  pthread_t thread;
+  int ix;
+
+  for(ix = 0; ix < g_opts.bg_threads; ix++) {
+    pthread_create(&thread, 0, bg_thread, 0);
+    pthread_detach(thread);
+  }
+}
+
+// Overload control
+//
+// Hits are cheap and always served.  A miss costs a transform, so while
+// the accept queue, the transform backlog or the miss latency is past its
+// limit new misses are turned away, until all three are back under three
+// quarters of their limits.  One miss is still let through whenever no
+// transform is running, which keeps the latency current.
+struct {
+  int 
+    active,
+    inflight;
+
+  // microseconds, moving average over recent misses
+  int64_t latency;
+
+  long long 
+    shed,
+    degraded,
+    episodes;
+} g_load;
+
+void load_sample(int64_t us) {
+  g_load.latency += (us - g_load.latency) / 8;
+}
+
+// Whether a miss should be turned away now
+int load_shed() {
+  struct mg_queue_stats qs;
+
+  int 
+    queued = 0,
+    backlog = g_load.inflight + g_bg.count,
+    latency = (int) (g_load.latency / 1000),
+    over,
+    under;
+
+  if(!g_opts.overload_queue && !g_opts.overload_transforms && !g_opts.overload_latency) {
+    return 0;
+  }
+
+  if(g_ctx) {
+    mg_get_queue_stats(g_ctx, &qs);
+    queued = qs.depth;
+  }
+
+  over = 
+    (g_opts.overload_queue && queued >= g_opts.overload_queue) ||
+    (g_opts.overload_transforms && backlog >= g_opts.overload_transforms) ||
+    (g_opts.overload_latency && latency >= g_opts.overload_latency);
+
+  under = 
+    (!g_opts.overload_queue || queued * 4 < g_opts.overload_queue * 3) &&
+    (!g_opts.overload_transforms || backlog * 4 < g_opts.overload_transforms * 3) &&
+    (!g_opts.overload_latency || latency * 4 < g_opts.overload_latency * 3);
+
+  if(over && __sync_bool_compare_and_swap(&g_load.active, 0, 1)) {
+    __sync_fetch_and_add(&g_load.episodes, 1);
+    plog1("Overloaded: %d queued, %d transforms, %d ms", queued, backlog, latency);
+  } else if(under && __sync_bool_compare_and_swap(&g_load.active, 1, 0)) {
+    plog1("Load back to normal: %d queued, %d transforms, %d ms", queued, backlog, latency);
+  }
+
+  return g_load.active && g_load.inflight;
+}
+
+void stats_merge(struct stats *out) {
+  struct stats *st;
+
+  int 
+    stage,
+    ix;
+
+  memset(out, 0, sizeof(struct stats));
+  pthread_mutex_lock(&g_stats_lock);
+  for(st = g_stats; st; st = st->next) {
+    for(stage = 0; stage < ST_COUNT; stage++) {
+      for(ix = 0; ix < HIST_BUCKETS; ix++) {
+        out->hist[stage][ix] += st->hist[stage][ix];
+      }
+      out->sum[stage] += st->sum[stage];
+      if(st->max[stage] > out->max[stage]) {
+        out->max[stage] = st->max[stage];
+      }
+    }
+    for(ix = 0; ix < C_COUNT; ix++) {
+      out->counter[ix] += st->counter[ix];
+    }
+  }
+  pthread_mutex_unlock(&g_stats_lock);
+}
+
+int64_t hist_count(const int64_t *hist) {
+  int64_t count = 0;
+  int ix;
+
+  for(ix = 0; ix < HIST_BUCKETS; ix++) {
+    count += hist[ix];
+  }
+  return count;
+}
+
+int64_t hist_quantile(const int64_t *hist, int64_t count, double q) {
+  int64_t 
+    rank = (int64_t) (q * count + 0.999999),
+    seen = 0;
+
+  int ix;
+
+  for(ix = 0; ix < HIST_BUCKETS; ix++) {
+    seen += hist[ix];
+    if(seen >= rank && seen) {
+      return hist_value(ix);
+    }
+  }
+  return 0;
+}
+
+// Wand memory is only known for the whole process, so this is the most
+// that was in use at any point while the request was transforming
+void trace_wand() {
+  int64_t used = (int64_t) MagickGetResource(MemoryResource);
+
+  if(used > t_req.wand_peak) {
+    t_req.wand_peak = used;
+  }
+}
+
+void trace_source(MagickWand *wand) {
+  char *format = MagickGetImageFormat(wand);
+
+  if(format) {
+    strncpy(t_req.format, format, sizeof(t_req.format) - 1);
+    MagickRelinquishMemory(format);
+  }
+  trace_wand();
+}
+
+void trace_step(MagickWand *wand, const char *directive, int64_t us) {
+  int left = sizeof(t_req.steps) - t_req.steps_len;
+  int len = snprintf(t_req.steps + t_req.steps_len, left, "%s%s:%lld", 
+    t_req.steps_len ? "," : "", directive, (long long) us);
+
+  t_req.steps_len += len < left ? len : left - 1;
+  trace_wand();
+}
+
+// The part of a line that the access and slow records share: what was
+// asked for, how it went and where the time went, as key=value pairs.
+// Stages that didn't run are left out.  The uri is cut short so the rest
+// usually fits, and the line is kept within log_append's bounds.
+int trace_line(char *line, const char *what, const char *uri) {
+  int 
+    len = log_stamp(line),
+    ix;
+
+  len += snprintf(line + len, LOG_LINE - 400 - len, "%s uri=%s", what, uri);
+  if(len > LOG_LINE - 400) {
+    len = LOG_LINE - 400;
+  }
+  len = log_append(line, len, " status=%d cache=%s bytes=%lld", 
+    t_req.status, t_req.outcome ? t_req.outcome : "NONE", (long long) t_req.bytes);
+
+  for(ix = 0; ix < ST_COUNT; ix++) {
+    if(t_req.stage[ix]) {
+      len = log_append(line, len, " %s_us=%lld", g_stage_names[ix], (long long) t_req.stage[ix]);
+    }
+  }
+  return len;
+}
+
+void log_access(const char *uri) {
+  char line[LOG_LINE];
+  int len = trace_line(line, "access", uri);
+
+  line[len++] = '\n';
+  log_put(line, len);
+}
+
+// Anything that took slow_ms or more, counting the time it waited to be
+// picked up, goes to slow_log (or the log) with everything known about
+// it, by way of the log rings.  At most slow_rate a second are written
+// and the rest are counted.
+void log_slow(const char *uri, int64_t us) {
+  // the second in the high bits and how many were written in it in the
+  // low ones, so moving on to the next second and counting are one swap
+  static volatile int64_t window = 0;
+  static volatile int skipped = 0;
+
+  char line[LOG_LINE];
+
+  int64_t 
+    now = time(0),
+    was,
+    next;
+
+  int 
+    len,
+    missed;
+
+  stat_count(C_SLOW, 1);
+
+  do {
+    was = window;
+    next = was >> 20 != now ? now << 20 | 1 : 
+      (was & 0xfffff) == 0xfffff ? was : was + 1;
+  } while(!__sync_bool_compare_and_swap(&window, was, next));
+
+  if((next & 0xfffff) > g_opts.slow_rate) {
+    __sync_fetch_and_add(&skipped, 1);
+    return;
+  }
+  missed = __sync_lock_test_and_set(&skipped, 0);
+
+  len = trace_line(line, "slow", uri);
+  len = log_append(line, len, " total_us=%lld queue_us=%lld", 
+    (long long) us, (long long) t_req.queued);
+
+  if(t_req.width) {
+    len = log_append(line, len, " src=%dx%d format=%s wand_peak=%lld", 
+      t_req.width, t_req.height, t_req.format[0] ? t_req.format : "?", (long long) t_req.wand_peak);
+  }
+  if(missed) {
+    len = log_append(line, len, " skipped=%d", missed);
+  }
+  if(t_req.steps_len) {
+    len = log_append(line, len, " steps=%s", t_req.steps);
+  }
+  line[len++] = '\n';
+
+  if(g_opts.slow_fd != -1) {
+    memmove(line + 1, line, len++);
+    line[0] = LOG_SLOW;
+  }
+  log_put(line, len);
+}
+
+// Hardware counters around the decode, each directive and the encode,
+// added up by stage and by the format of the original.  They count this
+// thread only, in user space, so work that ImageMagick hands to its own
+// OpenMP threads is missed; MAGICK_THREAD_LIMIT=1 keeps it all here.
+#define PMU_CYCLES        0
+#define PMU_INSTRUCTIONS  1
+#define PMU_CACHE_MISSES  2
+#define PMU_BRANCH_MISSES 3
+#define PMU_COUNT         4
+#define PMU_FORMATS       16
+
+const char *g_pmu_names[] = {
+  "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+struct pmu_read {
+  uint64_t value[PMU_COUNT];
+};
+
+struct {
+  char format[PMU_FORMATS][16];
+  int formats;
+
+  int64_t 
+    count[PMU_FORMATS][ST_COUNT],
+    value[PMU_FORMATS][ST_COUNT][PMU_COUNT];
+} g_pmu;
+
+pthread_mutex_t g_pmu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The group leader, -1 when the counters can't be had on this thread, and
+// where in a read of the group each counter is, -1 for one that's missing
+__thread int 
+  t_pmu_fd = 0,
+  t_pmu_slot[PMU_COUNT];
+
+#ifdef __linux__ // {
+int pmu_open() {
+  const uint64_t config[] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, 
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  struct perf_event_attr attr;
+
+  int 
+    slots = 0,
+    fd,
+    ix;
+
+  t_pmu_fd = -1;
+  for(ix = 0; ix < PMU_COUNT; ix++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[ix];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, t_pmu_fd, 0);
+    t_pmu_slot[ix] = fd == -1 ? -1 : slots++;
+
+    // without cycles there's no group
+    if(ix == PMU_CYCLES) {
+      if(fd == -1) {
+        plog1("No hardware counters: %d", errno);
+        return 0;
+      }
+      t_pmu_fd = fd;
+    }
+  }
+  return 1;
+}
+
+void pmu_sample(struct pmu_read *out) {
+  uint64_t buf[1 + PMU_COUNT] = {0};
+  int ix;
+
+  memset(out, 0, sizeof(*out));
+  if(!t_pmu_fd && !pmu_open()) {
+    return;
+  }
+  if(t_pmu_fd == -1 || read(t_pmu_fd, buf, sizeof(buf)) <= 0) {
+    return;
+  }
+  for(ix = 0; ix < PMU_COUNT; ix++) {
+    if(t_pmu_slot[ix] != -1) {
+      out->value[ix] = buf[1 + t_pmu_slot[ix]];
+    }
+  }
+}
+#else
+void pmu_sample(struct pmu_read *out) {
+  memset(out, 0, sizeof(*out));
+}
+#endif // }
+
+// Where a format's counts go, taking the next free one for a new format
+int pmu_format(const char *format) {
+  int ix;
+
+  for(ix = 0; ix < g_pmu.formats; ix++) {
+    if(!strcmp(g_pmu.format[ix], format)) {
+      return ix;
+    }
+  }
+
+  pthread_mutex_lock(&g_pmu_lock);
+  for(ix = 0; ix < g_pmu.formats; ix++) {
+    if(!strcmp(g_pmu.format[ix], format)) {
+      break;
+    }
+  }
+  if(ix == g_pmu.formats && ix < PMU_FORMATS) {
+    strncpy(g_pmu.format[ix], format, sizeof(g_pmu.format[ix]) - 1);
+    __sync_synchronize();
+    g_pmu.formats++;
+  }
+  pthread_mutex_unlock(&g_pmu_lock);
+
+  return ix < PMU_FORMATS ? ix : -1;
+}
+
+// Adds what the counters did since from to the stage
+void pmu_add(int stage, const struct pmu_read *from) {
+  struct pmu_read to;
+
+  int 
+    format,
+    ix;
+
+  pmu_sample(&to);
+  if(t_pmu_fd == -1) {
+    return;
+  }
+  format = pmu_format(t_req.format[0] ? t_req.format : "?");
+  if(format == -1) {
+    return;
+  }
+
+  __sync_fetch_and_add(&g_pmu.count[format][stage], 1);
+  for(ix = 0; ix < PMU_COUNT; ix++) {
+    __sync_fetch_and_add(&g_pmu.value[format][stage][ix], to.value[ix] - from->value[ix]);
+  }
+}
+
+// Popular recipes
+//
+// Every request for a derivative counts its recipe, which is what it asks
+// of its original: photo_r200x200.jpg from photo.jpg is "_r200x200", and
+// from photo.png it's "_r200x200.jpg".  The counts are halved every
+// RECIPE_HALFLIFE seconds, so they follow what's asked for now.  With
+// pregen_top set, an original that shows up under img_root gets that many
+// of the most asked for made in the background before anyone asks, see
+// pregen.  A recipe is found without a lock; only a new one takes it, and
+// it replaces the least counted one in its probe window when that's full.
+#define RECIPE_SLOTS    1024
+#define RECIPE_PROBE    8
+#define RECIPE_LEN      64
+#define RECIPE_HALFLIFE 600
+
+struct recipe {
+  volatile int64_t count;
+  volatile uint64_t hash;
+  char name[RECIPE_LEN];
+};
+
+struct recipe g_recipes[RECIPE_SLOTS];
+pthread_mutex_t g_recipe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// name was asked for and is made from orig
+void recipe_seen(const char *name, const char *orig) {
+  struct recipe 
+    *slot,
+    *pick = 0;
+
+  const char 
+    *ext = strrchr(orig, '.'),
+    *recipe;
+
+  char buf[RECIPE_LEN];
+  uint64_t hash;
+  int 
+    len,
+    ix;
+
+  // the original itself, or not made from it
+  len = ext && !strchr(ext, '/') ? ext - orig : (int) strlen(orig);
+  if(strncmp(name, orig, len) || name[len] != '_') {
+    return;
+  }
+
+  // what's the same as the original's extension is left off
+  recipe = name + len;
+  len = strlen(recipe);
+  if(ext && len > (int) strlen(ext) && !strcmp(recipe + len - strlen(ext), ext)) {
+    len -= strlen(ext);
+  }
+  if(len >= RECIPE_LEN) {
+    return;
+  }
+  memcpy(buf, recipe, len);
+  buf[len] = 0;
+  hash = hash_str(buf);
+
+  for(ix = 0; ix < RECIPE_PROBE; ix++) {
+    slot = &g_recipes[(hash + ix) % RECIPE_SLOTS];
+    if(slot->hash == hash && !strcmp(slot->name, buf)) {
+      __sync_fetch_and_add(&slot->count, 1);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&g_recipe_lock);
+  for(ix = 0; ix < RECIPE_PROBE; ix++) {
+    slot = &g_recipes[(hash + ix) % RECIPE_SLOTS];
+    if(slot->hash == hash && !strcmp(slot->name, buf)) {
+      break;
+    }
+    if(!pick || slot->count < pick->count) {
+      pick = slot;
+    }
+  }
+  if(ix == RECIPE_PROBE) {
+    slot = pick;
+    slot->hash = 0;
+    __sync_synchronize();
+    strcpy(slot->name, buf);
+    slot->count = 0;
+    __sync_synchronize();
+    slot->hash = hash;
+  }
+  __sync_fetch_and_add(&slot->count, 1);
+  pthread_mutex_unlock(&g_recipe_lock);
+}
+
+void recipe_decay() {
+  static time_t last = 0;
+  int ix;
+
+  if(!last) {
+    last = time(0);
+  }
+  if(time(0) - last < RECIPE_HALFLIFE) {
+    return;
+  }
+  last = time(0);
+  for(ix = 0; ix < RECIPE_SLOTS; ix++) {
+    g_recipes[ix].count /= 2;
+  }
+}
+
+// Copies the n most asked for recipes into names, most first, with their
+// counts.  Returns how many there were.
+int recipe_top(char (*names)[RECIPE_LEN], int64_t *counts, int n) {
+  int64_t count;
+  int 
+    found = 0,
+    ix,
+    at;
+
+  for(ix = 0; ix < RECIPE_SLOTS; ix++) {
+    count = g_recipes[ix].count;
+    if(!g_recipes[ix].hash || count <= 0) {
+      continue;
+    }
+    for(at = found < n ? found++ : n; at > 0 && counts[at - 1] < count; at--) {
+      if(at < n) {
+        counts[at] = counts[at - 1];
+        memcpy(names[at], names[at - 1], RECIPE_LEN);
+      }
+    }
+    if(at < n) {
+      counts[at] = count;
+      memcpy(names[at], g_recipes[ix].name, RECIPE_LEN);
+      names[at][RECIPE_LEN - 1] = 0;
+    }
+  }
+  return found;
+}
+
+// The reserved STATS_URL, as JSON or with ?prometheus as Prometheus text
+#define STATS_URL     "/_stats"
+#define STATS_BUF     32768
+
+void *show_stats(struct mg_connection *conn) {
+  const char *query = mg_get_request_info(conn)->query_string;
+  const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  const char *qnames[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+
+  struct stats *all = (struct stats*) malloc(sizeof(struct stats));
+  struct mg_queue_stats qs;
+
+  char names[PREGEN_MAX][RECIPE_LEN];
+  int64_t counts[PREGEN_MAX];
+
+  cJSON 
+    *root,
+    *node,
+    *format,
+    *stage;
+
+  char *out;
+
+  int 
+    len = 0,
+    ix,
+    iq,
+    ip;
+
+  int64_t count;
+
+  stats_merge(all);
+  memset(&qs, 0, sizeof(qs));
+  if(g_ctx) {
+    mg_get_queue_stats(g_ctx, &qs);
+  }
+
+  if(query && strstr(query, "prometheus")) {
+    out = (char*) malloc(STATS_BUF);
+
+#define PROM(...) len += snprintf(out + len, len < STATS_BUF ? STATS_BUF - len : 0, __VA_ARGS__)
+    PROM("# TYPE apophnia_responses_total counter\n");
+    PROM("apophnia_responses_total{cache=\"hit\"} %lld\n", (long long) all->counter[C_HIT]);
+    PROM("apophnia_responses_total{cache=\"miss\"} %lld\n", (long long) all->counter[C_MISS]);
+    PROM("apophnia_responses_total{cache=\"stale\"} %lld\n", (long long) all->counter[C_STALE]);
+    PROM("apophnia_responses_total{cache=\"degraded\"} %lld\n", g_load.degraded);
+    PROM("apophnia_responses_total{cache=\"shed\"} %lld\n", g_load.shed);
+    PROM("apophnia_responses_total{cache=\"not_found\"} %lld\n", (long long) all->counter[C_404]);
+    PROM("# TYPE apophnia_coalesced_total counter\n");
+    PROM("apophnia_coalesced_total %lld\n", (long long) all->counter[C_COALESCED]);
+    PROM("# TYPE apophnia_sent_bytes_total counter\n");
+    PROM("apophnia_sent_bytes_total %lld\n", (long long) all->counter[C_BYTES]);
+    PROM("# TYPE apophnia_slow_requests_total counter\n");
+    PROM("apophnia_slow_requests_total %lld\n", (long long) all->counter[C_SLOW]);
+    PROM("# TYPE apophnia_pregenerated_total counter\n");
+    PROM("apophnia_pregenerated_total %lld\n", (long long) all->counter[C_PREGEN]);
+    PROM("# TYPE apophnia_prefixes_kept_total counter\n");
+    PROM("apophnia_prefixes_kept_total %lld\n", (long long) all->counter[C_PREFIX]);
+    PROM("# TYPE apophnia_log_dropped_total counter\n");
+    PROM("apophnia_log_dropped_total %lld\n", (long long) log_dropped());
+    PROM("# TYPE apophnia_overload_episodes_total counter\n");
+    PROM("apophnia_overload_episodes_total %lld\n", g_load.episodes);
+    PROM("# TYPE apophnia_overloaded gauge\n");
+    PROM("apophnia_overloaded %d\n", g_load.active);
+    PROM("# TYPE apophnia_transforms_in_flight gauge\n");
+    PROM("apophnia_transforms_in_flight %d\n", g_load.inflight);
+    PROM("# TYPE apophnia_background_queue gauge\n");
+    PROM("apophnia_background_queue %d\n", g_bg.count);
+    PROM("# TYPE apophnia_decoded_pixels gauge\n");
+    PROM("apophnia_decoded_pixels %lld\n", (long long) g_pixels);
+    PROM("# TYPE apophnia_accept_queue gauge\n");
+    PROM("apophnia_accept_queue %d\n", qs.depth);
+    PROM("# TYPE apophnia_parked_connections gauge\n");
+    PROM("apophnia_parked_connections %d\n", qs.parked);
+    PROM("# TYPE apophnia_accept_queue_wait_seconds summary\n");
+    PROM("apophnia_accept_queue_wait_seconds_sum %.9f\n", qs.wait_ns / 1e9);
+    PROM("apophnia_accept_queue_wait_seconds_count %lld\n", qs.accepted);
+    PROM("# TYPE apophnia_stage_seconds summary\n");
+    for(ix = 0; ix < ST_COUNT; ix++) {
+      count = hist_count(all->hist[ix]);
+      for(iq = 0; iq < 4; iq++) {
+        PROM("apophnia_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n", 
+          g_stage_names[ix], quantiles[iq], hist_quantile(all->hist[ix], count, quantiles[iq]) / 1e6);
+      }
+      PROM("apophnia_stage_seconds_sum{stage=\"%s\"} %.6f\n", g_stage_names[ix], all->sum[ix] / 1e6);
+      PROM("apophnia_stage_seconds_count{stage=\"%s\"} %lld\n", g_stage_names[ix], (long long) count);
+    }
+    if(g_opts.perf_counters) {
+      for(iq = 0; iq < PMU_COUNT; iq++) {
+        PROM("# TYPE apophnia_stage_%s_total counter\n", g_pmu_names[iq]);
+        for(ip = 0; ip < g_pmu.formats; ip++) {
+          for(ix = 0; ix < ST_COUNT; ix++) {
+            if(g_pmu.count[ip][ix]) {
+              PROM("apophnia_stage_%s_total{stage=\"%s\",format=\"%s\"} %lld\n", 
+                g_pmu_names[iq], g_stage_names[ix], g_pmu.format[ip], (long long) g_pmu.value[ip][ix][iq]);
+            }
+          }
+        }
+      }
+    }
+#undef PROM
+
+    if(len >= STATS_BUF) {
+      len = STATS_BUF - 1;
+    }
+    mg_printf(conn, "%s", "HTTP/1.1 200 OK\r\n");
+    mg_printf(conn, "%s", "Content-Type: text/plain; version=0.0.4\r\n");
+  } else {
+    root = cJSON_CreateObject();
+
+    cJSON_AddItemToObject(root, "responses", node = cJSON_CreateObject());
+    cJSON_AddNumberToObject(node, "hit", all->counter[C_HIT]);
+    cJSON_AddNumberToObject(node, "miss", all->counter[C_MISS]);
+    cJSON_AddNumberToObject(node, "stale", all->counter[C_STALE]);
+    cJSON_AddNumberToObject(node, "degraded", g_load.degraded);
+    cJSON_AddNumberToObject(node, "shed", g_load.shed);
+    cJSON_AddNumberToObject(node, "not_found", all->counter[C_404]);
+    cJSON_AddNumberToObject(root, "coalesced", all->counter[C_COALESCED]);
+    cJSON_AddNumberToObject(root, "sent_bytes", all->counter[C_BYTES]);
+    cJSON_AddNumberToObject(root, "slow", all->counter[C_SLOW]);
+    cJSON_AddNumberToObject(root, "pregenerated", all->counter[C_PREGEN]);
+    cJSON_AddNumberToObject(root, "prefixes_kept", all->counter[C_PREFIX]);
+    if(g_opts.pregen_top) {
+      cJSON_AddItemToObject(root, "recipes", node = cJSON_CreateObject());
+      count = recipe_top(names, counts, g_opts.pregen_top < PREGEN_MAX ? g_opts.pregen_top : PREGEN_MAX);
+      for(ix = 0; ix < count; ix++) {
+        cJSON_AddNumberToObject(node, names[ix], counts[ix]);
+      }
+    }
+    cJSON_AddNumberToObject(root, "log_dropped", log_dropped());
+
+    cJSON_AddItemToObject(root, "overload", node = cJSON_CreateObject());
+    cJSON_AddNumberToObject(node, "active", g_load.active);
+    cJSON_AddNumberToObject(node, "episodes", g_load.episodes);
+    cJSON_AddNumberToObject(node, "latency_us", g_load.latency);
+    cJSON_AddNumberToObject(node, "transforms_in_flight", g_load.inflight);
+    cJSON_AddNumberToObject(node, "background_queue", g_bg.count);
+    cJSON_AddNumberToObject(node, "decoded_pixels", g_pixels);
+
+    cJSON_AddItemToObject(root, "accept_queue", node = cJSON_CreateObject());
+    cJSON_AddNumberToObject(node, "depth", qs.depth);
+    cJSON_AddNumberToObject(node, "capacity", qs.capacity);
+    cJSON_AddNumberToObject(node, "acceptors", qs.acceptors);
+    cJSON_AddNumberToObject(node, "parked", qs.parked);
+    cJSON_AddNumberToObject(node, "accepted", qs.accepted);
+    cJSON_AddNumberToObject(node, "wait_mean_us", qs.accepted ? qs.wait_ns / qs.accepted / 1000 : 0);
+    cJSON_AddNumberToObject(node, "wait_max_us", qs.max_wait_ns / 1000);
+
+    cJSON_AddItemToObject(root, "stages", node = cJSON_CreateObject());
+    for(ix = 0; ix < ST_COUNT; ix++) {
+      count = hist_count(all->hist[ix]);
+      cJSON_AddItemToObject(node, g_stage_names[ix], stage = cJSON_CreateObject());
+      cJSON_AddNumberToObject(stage, "count", count);
+      cJSON_AddNumberToObject(stage, "sum_us", all->sum[ix]);
+      cJSON_AddNumberToObject(stage, "max_us", all->max[ix]);
+      for(iq = 0; iq < 4; iq++) {
+        cJSON_AddNumberToObject(stage, qnames[iq], hist_quantile(all->hist[ix], count, quantiles[iq]));
+      }
+    }
+
+    if(g_opts.perf_counters) {
+      cJSON_AddItemToObject(root, "perf_counters", node = cJSON_CreateObject());
+      for(ip = 0; ip < g_pmu.formats; ip++) {
+        cJSON_AddItemToObject(node, g_pmu.format[ip], format = cJSON_CreateObject());
+        for(ix = 0; ix < ST_COUNT; ix++) {
+          if(!g_pmu.count[ip][ix]) {
+            continue;
+          }
+          cJSON_AddItemToObject(format, g_stage_names[ix], stage = cJSON_CreateObject());
+          cJSON_AddNumberToObject(stage, "count", g_pmu.count[ip][ix]);
+          for(iq = 0; iq < PMU_COUNT; iq++) {
+            cJSON_AddNumberToObject(stage, g_pmu_names[iq], g_pmu.value[ip][ix][iq]);
+          }
+          cJSON_AddNumberToObject(stage, "ipc", g_pmu.value[ip][ix][PMU_CYCLES] ? 
+            (double) g_pmu.value[ip][ix][PMU_INSTRUCTIONS] / g_pmu.value[ip][ix][PMU_CYCLES] : 0);
+        }
+      }
+    }
+
+    out = cJSON_Print(root);
+    len = strlen(out);
+    cJSON_Delete(root);
+
+    mg_printf(conn, "%s", "HTTP/1.1 200 OK\r\n");
+    mg_printf(conn, "%s", "Content-Type: application/json\r\n");
+  }
+
+  mg_printf(conn, "%s", "Cache-Control: no-store\r\n");
+  mg_printf(conn, "Content-Length: %d\r\n\r\n", len);
+  mg_write(conn, out, len);
+
+  free(out);
+  free(all);
+  return (void*)1;
+}
+
+// The derivative index
+//
+// A fixed size, open addressed hash table of idx_rec kept in a file that
+// is mmap'd MAP_SHARED, so it survives restarts (and crashes of the
+// process) as is.  The first record is a header.  Every record carries a
+// checksum that is cleared before and set after it is written; a record
+// torn by a machine crash fails it and is treated as a tombstone, which
+// keeps the probe chains going through it intact.  atime is advisory and
+// isn't covered.
+//
+// The derivative itself is at cache_path(key), or if pack is set, at offset
+// in that pack file.
+#define IDX_MAGIC     0x5844494f504f5041ULL
+#define IDX_VERSION   3
+#define IDX_KEYLEN    208
+#define IDX_PROBE     32
+
+#define IDX_LIVE      1
+#define IDX_DEAD      2
+
+struct idx_rec {
+  uint64_t hash;
+  uint32_t 
+    sum,
+    flags;
+
+  int64_t 
+    atime,
+    created,
+    // when the original changed under it, if it did
+    stale;
+
+  uint64_t 
+    size,
+    etag,
+    src_ino;
+
+  int64_t
+    src_mtime,
+    src_size;
+
+  uint32_t 
+    pack,
+    unused;
+
+  uint64_t offset;
+
+  // the canonical recipe, and the original in img_root it was made from
+  char 
+    key[IDX_KEYLEN],
+    src[IDX_KEYLEN];
+};
+
+struct idx_head {
+  uint64_t magic;
+  uint32_t 
+    version,
+    rec_size;
+  uint64_t slots;
+};
+
+struct idx_rec *g_idx = 0;
+uint64_t g_idx_slots = 0;
+pthread_mutex_t g_idx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Pack files
+//
+// Derivatives up to pack_max bytes are appended to one active pack file
+// at a time instead of getting a file each.  The index says where they
+// are.  Each entry carries a copy of its record, so that whatever got into
+// a pack after the last checkpoint can be put back in the index after a
+// crash.  Packs that are mostly dead are compacted in the background.
+#define PACK_MAGIC    0x4b434150
+
+struct pack {
+  int fd;
+  uint64_t 
+    size,
+    live;
+};
+
+struct pack_entry {
+  uint32_t 
+    magic,
+    sum;
+  uint64_t size;
+  struct idx_rec rec;
+};
+
+// what an entry of size bytes takes up in its pack, kept 8 byte aligned
+#define PACK_SPAN(size) ((sizeof(struct pack_entry) + (size) + 7) & ~7)
+
+struct pack *g_pack = 0;
+int 
+  g_pack_count = 0,
+  g_pack_active = 0;
+pthread_mutex_t g_pack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void pack_live(uint32_t id, int64_t delta) {
+  pthread_mutex_lock(&g_pack_lock);
+  if(id < (uint32_t) g_pack_count) {
+    g_pack[id].live += delta;
+  }
+  pthread_mutex_unlock(&g_pack_lock);
+}
+
+// Lets go of where a derivative is stored
+void cache_remove(const struct idx_rec *rec) {
+  char path[PATH_MAX];
+
+  if(rec->pack) {
+    pack_live(rec->pack, - (int64_t) PACK_SPAN(rec->size));
+  } else {
+    cache_path(rec->key, path);
+    unlinkat(g_cache_fd, path, 0);
+  }
+}
+
+// The dependency graph
+//
+// Every original that derivatives were made from, mapped to the recipe
+// keys of those derivatives.  It's built from the index at startup and
+// kept up as records come and go, so that when inotify says an original
+// changed, everything made from it can be thrown out at once.
+#define DEP_BUCKETS   16384
+
+struct dep {
+  char 
+    *src,
+    **keys;
+
+  int 
+    count,
+    size;
+
+  struct dep *next;
+};
+
+struct dep *g_deps[DEP_BUCKETS];
+pthread_mutex_t g_dep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void dep_add(const char *src, const char *key) {
+  struct dep *node;
+  int ix;
+
+  pthread_mutex_lock(&g_dep_lock);
+  for(node = g_deps[hash_str(src) % DEP_BUCKETS]; node; node = node->next) {
+    if(!strcmp(node->src, src)) {
+      break;
+    }
+  }
+
+  if(!node) {
+    node = (struct dep*) calloc(1, sizeof(struct dep));
+    node->src = strdup(src);
+    node->next = g_deps[hash_str(src) % DEP_BUCKETS];
+    g_deps[hash_str(src) % DEP_BUCKETS] = node;
+  }
+
+  for(ix = 0; ix < node->count; ix++) {
+    if(!strcmp(node->keys[ix], key)) {
+      break;
+    }
+  }
+
+  if(ix == node->count) {
+    if(node->count == node->size) {
+      node->size = node->size ? node->size * 2 : 4;
+      node->keys = (char**) realloc(node->keys, node->size * sizeof(char*));
+    }
+    node->keys[node->count++] = strdup(key);
+  }
+  pthread_mutex_unlock(&g_dep_lock);
+}
+
+void dep_remove(const char *src, const char *key) {
+  struct dep *node;
+  int ix;
+
+  pthread_mutex_lock(&g_dep_lock);
+  for(node = g_deps[hash_str(src) % DEP_BUCKETS]; node; node = node->next) {
+    if(!strcmp(node->src, src)) {
+      for(ix = 0; ix < node->count; ix++) {
+        if(!strcmp(node->keys[ix], key)) {
+          free(node->keys[ix]);
+          node->keys[ix] = node->keys[--node->count];
+          break;
+        }
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_dep_lock);
+}
+
+void dep_free(struct dep *node) {
+  while(node->count) {
+    free(node->keys[--node->count]);
+  }
+  free(node->keys);
+  free(node->src);
+  free(node);
+}
+
+// Takes the derivatives of src, or with tree set, of everything under it,
+// out of the graph.  They are handed back as a list.
+struct dep *dep_detach(const char *src, int tree) {
+  struct dep 
+    **pNode,
+    *node,
+    *list = 0;
+
+  size_t len = strlen(src);
+  int 
+    ix = hash_str(src) % DEP_BUCKETS,
+    end = ix + 1;
+
+  if(tree) {
+    ix = 0;
+    end = DEP_BUCKETS;
+  }
+
+  pthread_mutex_lock(&g_dep_lock);
+  for(; ix < end; ix++) {
+    for(pNode = &g_deps[ix]; *pNode;) {
+      node = *pNode;
+      if(!strncmp(node->src, src, len) && 
+        (!node->src[len] || (tree && node->src[len] == '/'))
+      ) {
+        *pNode = node->next;
+        node->next = list;
+        list = node;
+      } else {
+        pNode = &node->next;
+      }
+    }
+  }
+  pthread_mutex_unlock(&g_dep_lock);
+
+  return list;
+}
+
+// Copies out every original in the graph, or with src given, the keys of
+// what was made from it, so they can be gone through without the lock.
+// The list and its strings are the caller's to free.
+char **dep_list(const char *src, int *count) {
+  struct dep *node;
+  char **list = 0;
+  int 
+    ix = src ? hash_str(src) % DEP_BUCKETS : 0,
+    end = src ? ix + 1 : DEP_BUCKETS,
+    size = 0,
+    jx;
+
+  *count = 0;
+  pthread_mutex_lock(&g_dep_lock);
+  for(; ix < end; ix++) {
+    for(node = g_deps[ix]; node; node = node->next) {
+      if(src && strcmp(node->src, src)) {
+        continue;
+      }
+      for(jx = 0; jx < (src ? node->count : 1); jx++) {
+        if(*count == size) {
+          size = size ? size * 2 : 64;
+          list = (char**) realloc(list, size * sizeof(char*));
+        }
+        list[(*count)++] = strdup(src ? node->keys[jx] : node->src);
+      }
+    }
+  }
+  pthread_mutex_unlock(&g_dep_lock);
+
+  return list;
+}
+
+
+uint32_t idx_sum(const struct idx_rec *rec) {
+  struct idx_rec copy;
+  const unsigned char *ptr = (const unsigned char*) &copy;
+  uint32_t sum = 2166136261U;
+  size_t ix;
+
+  memcpy(&copy, rec, sizeof(copy));
+  copy.sum = 0;
+  copy.atime = 0;
+
+  for(ix = 0; ix < sizeof(copy); ix++) {
+    sum ^= ptr[ix];
+    sum *= 16777619U;
+  }
+
+  // never 0, which is what a record being written has
+  return sum | 1;
+}
+
+int idx_open() {
+  int fd;
+  uint64_t ix;
+  size_t len;
+  struct stat st;
+  struct idx_head *head;
+
+  if(!g_idx_slots) {
+    return 0;
+  }
+
+  len = (g_idx_slots + 1) * sizeof(struct idx_rec);
+
+  fd = openat(g_cache_fd, g_opts.index_file, O_RDWR | O_CREAT, 0644);
+  if(fd == -1 || fstat(fd, &st)) {
+    fatal("Couldn't open the index %s", g_opts.index_file);
+  }
+
+  g_idx = (struct idx_rec*) mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(g_idx == MAP_FAILED) {
+    fatal("mmap failure");
+  }
+
+  // this is the header
+  head = (struct idx_head*) g_idx;
+
+  if((size_t) st.st_size != len || 
+    head->magic != IDX_MAGIC || 
+    head->version != IDX_VERSION ||
+    head->rec_size != sizeof(struct idx_rec) ||
+    head->slots != g_idx_slots
+  ) {
+    if(st.st_size) {
+      plog0("The index %s doesn't match the configuration, starting over", g_opts.index_file);
+    }
+    // the file is sparse, so this costs nothing until it's used
+    munmap(g_idx, len);
+    if(ftruncate(fd, 0) || ftruncate(fd, len)) {
+      fatal("Couldn't size the index %s", g_opts.index_file);
+    }
+    g_idx = (struct idx_rec*) mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(g_idx == MAP_FAILED) {
+      fatal("mmap failure");
+    }
+    head = (struct idx_head*) g_idx;
+    head->slots = g_idx_slots;
+    head->rec_size = sizeof(struct idx_rec);
+    head->version = IDX_VERSION;
+    head->magic = IDX_MAGIC;
+  }
+  close(fd);
+
+  // skip over the header
+  g_idx++;
+
+  for(ix = 0; ix < g_idx_slots; ix++) {
+    if(g_idx[ix].flags == IDX_LIVE) {
+      if(g_idx[ix].sum == idx_sum(g_idx + ix)) {
+        dep_add(g_idx[ix].src, g_idx[ix].key);
+        if(g_idx[ix].pack) {
+          pack_live(g_idx[ix].pack, PACK_SPAN(g_idx[ix].size));
+        }
+      } else {
+        g_idx[ix].flags = IDX_DEAD;
+      }
+    }
+  }
+
+  plog3("Index %s: %d slots", g_opts.index_file, (int) g_idx_slots);
+  return 1;
+}
+
+// Finds the slot for key, or an empty one to put it in.  If the probe 
+// window is full, the least recently used record in it is the answer.
+// The caller holds the lock.
+struct idx_rec *idx_slot(uint64_t hash, const char *key) {
+  struct idx_rec 
+    *rec,
+    *empty = 0,
+    *oldest = 0;
+
+  int ix;
+
+  for(ix = 0; ix < IDX_PROBE; ix++) {
+    rec = g_idx + ((hash + ix) % g_idx_slots);
+
+    if(!rec->flags) {
+      return empty ? empty : rec;
+    }
+
+    if(rec->flags != IDX_LIVE) {
+      if(!empty) {
+        empty = rec;
+      }
+      continue;
+    }
+
+    if(rec->hash == hash && !strncmp(rec->key, key, IDX_KEYLEN - 1)) {
+      if(rec->sum == idx_sum(rec)) {
+        return rec;
+      }
+      rec->flags = IDX_DEAD;
+      if(!empty) {
+        empty = rec;
+      }
+      continue;
+    }
+
+    if(!oldest || rec->atime < oldest->atime) {
+      oldest = rec;
+    }
+  }
+
+  return empty ? empty : oldest;
+}
+
+// Copies out the record for key, if there is one, and touches it.
+int idx_get(const char *key, struct idx_rec *out) {
+  struct idx_rec *rec;
+  uint64_t hash = hash_str(key);
+  int ret = 0;
+
+  pthread_mutex_lock(&g_idx_lock);
+  rec = idx_slot(hash, key);
+  if(rec->flags == IDX_LIVE && rec->hash == hash && !strncmp(rec->key, key, IDX_KEYLEN - 1)) {
+    rec->atime = time(0);
+    memcpy(out, rec, sizeof(struct idx_rec));
+    ret = 1;
+  }
+  pthread_mutex_unlock(&g_idx_lock);
+
+  return ret;
+}
+
+// Like idx_get, but without it counting as a use
+int idx_peek(const char *key, struct idx_rec *out) {
+  struct idx_rec *rec;
+  uint64_t hash = hash_str(key);
+  int ret = 0;
+
+  pthread_mutex_lock(&g_idx_lock);
+  rec = idx_slot(hash, key);
+  if(rec->flags == IDX_LIVE && rec->hash == hash && !strncmp(rec->key, key, IDX_KEYLEN - 1)) {
+    memcpy(out, rec, sizeof(struct idx_rec));
+    ret = 1;
+  }
+  pthread_mutex_unlock(&g_idx_lock);
+
+  return ret;
+}
+
+void idx_put(struct idx_rec *in) {
+  struct idx_rec *rec;
+
+  in->hash = hash_str(in->key);
+  in->flags = IDX_LIVE;
+  in->sum = idx_sum(in);
+
+  pthread_mutex_lock(&g_idx_lock);
+  rec = idx_slot(in->hash, in->key);
+
+  // Pushing out a record pushes out its derivative too; without a record
+  // nobody would know when it went stale.
+  if(rec->flags == IDX_LIVE && rec->hash != in->hash) {
+    cache_remove(rec);
+    dep_remove(rec->src, rec->key);
+    plog3("Evicted %s", rec->key);
+
+  // A new version in a file goes right where the old one was
+  } else if(rec->flags == IDX_LIVE && (rec->pack || in->pack)) {
+    cache_remove(rec);
+  }
+
+  if(in->pack) {
+    pack_live(in->pack, PACK_SPAN(in->size));
+  }
+
+  rec->sum = 0;
+  __sync_synchronize();
+  memcpy((char*) rec + sizeof(uint64_t) + sizeof(uint32_t), 
+    (char*) in + sizeof(uint64_t) + sizeof(uint32_t),
+    sizeof(struct idx_rec) - sizeof(uint64_t) - sizeof(uint32_t)
+  );
+  rec->hash = in->hash;
+  __sync_synchronize();
+  rec->sum = in->sum;
+  dep_add(in->src, in->key);
+  pthread_mutex_unlock(&g_idx_lock);
+}
+
+// Drops the record for key, and the derivative with it.  If src is given,
+// only if it was made from src.
+int idx_drop(const char *key, const char *src) {
+  struct idx_rec *rec;
+  uint64_t hash = hash_str(key);
+  int ret = 0;
+
+  pthread_mutex_lock(&g_idx_lock);
+  rec = idx_slot(hash, key);
+  if(rec->flags == IDX_LIVE && rec->hash == hash && !strncmp(rec->key, key, IDX_KEYLEN - 1) &&
+    (!src || !strcmp(rec->src, src))
+  ) {
+    rec->flags = IDX_DEAD;
+    cache_remove(rec);
+    dep_remove(rec->src, rec->key);
+    ret = 1;
+  }
+  pthread_mutex_unlock(&g_idx_lock);
+
+  return ret;
+}
+
+// Marks the record for key, made from src, as stale as of now, unless it
+// already is.
+int idx_stale(const char *key, const char *src) {
+  struct idx_rec *rec;
+  uint64_t hash = hash_str(key);
+  int ret = 0;
+
+  pthread_mutex_lock(&g_idx_lock);
+  rec = idx_slot(hash, key);
+  if(rec->flags == IDX_LIVE && rec->hash == hash && !strncmp(rec->key, key, IDX_KEYLEN - 1) &&
+    !strcmp(rec->src, src)
+  ) {
+    if(!rec->stale) {
+      rec->sum = 0;
+      __sync_synchronize();
+      rec->stale = time(0);
+      __sync_synchronize();
+      rec->sum = idx_sum(rec);
+    }
+    ret = 1;
+  }
+  pthread_mutex_unlock(&g_idx_lock);
+
+  return ret;
+}
+
+// The tag of a derivative in a file of its own: its record's and the
+// file's, as the file is replaced by each new version ahead of the record
+uint64_t idx_file_etag(uint64_t etag, const struct stat *st) {
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "%016llx:%llu:%lld", 
+    (unsigned long long) etag, 
+    (unsigned long long) st->st_ino, 
+    (long long) st->st_size
+  );
+  return hash_str(buf);
+}
+
+uint64_t idx_etag(const struct idx_rec *rec) {
+  char buf[IDX_KEYLEN + 64];
+
+  snprintf(buf, sizeof(buf), "%s:%llu:%lld:%lld", rec->key, 
+    (unsigned long long) rec->src_ino,
+    (long long) rec->src_mtime,
+    (long long) rec->src_size
+  );
+  return hash_str(buf);
+}
+
+// Whether the record for key is at offset in pack
+int idx_at(const char *key, uint32_t pack, uint64_t offset) {
+  struct idx_rec *rec;
+  uint64_t hash = hash_str(key);
+  int ret;
+
+  pthread_mutex_lock(&g_idx_lock);
+  rec = idx_slot(hash, key);
+  ret = rec->flags == IDX_LIVE && rec->hash == hash && !strncmp(rec->key, key, IDX_KEYLEN - 1) &&
+    rec->pack == pack && rec->offset == offset;
+  pthread_mutex_unlock(&g_idx_lock);
+
+  return ret;
+}
+
+// Moves the record for key from where it was in a pack to where it is
+// now, unless it changed in the meantime.
+int idx_move(const char *key, uint32_t pack, uint64_t offset, const struct idx_rec *to) {
+  struct idx_rec *rec;
+  uint64_t hash = hash_str(key);
+  int ret = 0;
+
+  pthread_mutex_lock(&g_idx_lock);
+  rec = idx_slot(hash, key);
+  if(rec->flags == IDX_LIVE && rec->hash == hash && !strncmp(rec->key, key, IDX_KEYLEN - 1) &&
+    rec->pack == pack && rec->offset == offset
+  ) {
+    rec->sum = 0;
+    __sync_synchronize();
+    rec->pack = to->pack;
+    rec->offset = to->offset;
+    __sync_synchronize();
+    rec->sum = idx_sum(rec);
+    pack_live(pack, - (int64_t) PACK_SPAN(rec->size));
+    pack_live(to->pack, PACK_SPAN(rec->size));
+    ret = 1;
+  }
+  pthread_mutex_unlock(&g_idx_lock);
+
+  return ret;
+}
+
+uint32_t pack_sum(const struct pack_entry *entry, const unsigned char *data) {
+  struct idx_rec copy;
+  const unsigned char *ptr = (const unsigned char*) &copy;
+  uint32_t sum = 2166136261U;
+  size_t ix;
+
+  memcpy(&copy, &entry->rec, sizeof(copy));
+  copy.sum = 0;
+  copy.atime = 0;
+
+  for(ix = 0; ix < sizeof(copy); ix++) {
+    sum = (sum ^ ptr[ix]) * 16777619U;
+  }
+  for(ix = 0; ix < entry->size; ix++) {
+    sum = (sum ^ data[ix]) * 16777619U;
+  }
+
+  return sum;
+}
+
+// A descriptor of its own on the pack rec is in, which stays good even if
+// the pack is compacted away while it's being read.
+int pack_fd(const struct idx_rec *rec) {
+  int fd = -1;
+
+  pthread_mutex_lock(&g_pack_lock);
+  if(rec->pack < (uint32_t) g_pack_count && g_pack[rec->pack].fd != -1 && 
+    rec->offset + rec->size <= g_pack[rec->pack].size
+  ) {
+    fd = dup(g_pack[rec->pack].fd);
+  }
+  pthread_mutex_unlock(&g_pack_lock);
+
+  return fd;
+}
+
+void pack_name(int id, char *name) {
+  sprintf(name, "packs/%08x.pack", id);
+}
+
+// Makes room for pack id in g_pack.  The caller holds the lock.
+void pack_grow(int id) {
+  if(id >= g_pack_count) {
+    g_pack = (struct pack*) realloc(g_pack, (id + 1) * sizeof(struct pack));
+    for(; g_pack_count <= id; g_pack_count++) {
+      g_pack[g_pack_count].fd = -1;
+      g_pack[g_pack_count].size = g_pack[g_pack_count].live = 0;
+    }
+  }
+}
+
+// Starts a new active pack.  The caller holds the lock.
+int pack_roll() {
+  char name[PATH_MAX];
+  int id = g_pack_count ? g_pack_count : 1;
+
+  // what's in the last one has to be on disk before a checkpoint names a
+  // later one
+  if(g_pack_active) {
+    fdatasync(g_pack[g_pack_active].fd);
+  }
+
+  pack_grow(id);
+  pack_name(id, name);
+  g_pack[id].fd = openat(g_cache_fd, name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if(g_pack[id].fd == -1) {
+    plog0("Couldn't create %s", name);
+    return 0;
+  }
+
+  g_pack_active = id;
+  plog1("Created %s", name);
+  return 1;
+}
+
+// Appends a derivative to the active pack and sets where it went in rec
+int pack_append(struct idx_rec *rec, const unsigned char *data, size_t sz) {
+  struct pack_entry entry;
+  struct iovec iov[3];
+  char pad[8] = {0};
+  size_t total;
+  ssize_t ret;
+
+  memset(&entry, 0, sizeof(entry));
+  entry.magic = PACK_MAGIC;
+  entry.size = sz;
+
+  total = PACK_SPAN(sz);
+
+  iov[0].iov_base = &entry;
+  iov[0].iov_len = sizeof(entry);
+  iov[1].iov_base = (void*) data;
+  iov[1].iov_len = sz;
+  iov[2].iov_base = pad;
+  iov[2].iov_len = total - sizeof(entry) - sz;
+
+  pthread_mutex_lock(&g_pack_lock);
+  if(!g_pack_active || g_pack[g_pack_active].size + total > (uint64_t) g_opts.pack_size) {
+    if(!pack_roll()) {
+      pthread_mutex_unlock(&g_pack_lock);
+      return 0;
+    }
+  }
+
+  rec->pack = g_pack_active;
+  rec->offset = g_pack[g_pack_active].size + sizeof(entry);
+  memcpy(&entry.rec, rec, sizeof(entry.rec));
+  entry.sum = pack_sum(&entry, data);
+
+  ret = pwritev(g_pack[g_pack_active].fd, iov, 3, g_pack[g_pack_active].size);
+  if(ret == (ssize_t) total) {
+    g_pack[g_pack_active].size += total;
+  }
+  pthread_mutex_unlock(&g_pack_lock);
+
+  if(ret != (ssize_t) total) {
+    plog0("Couldn't append to pack %d", rec->pack);
+    rec->pack = 0;
+    return 0;
+  }
+
+  return 1;
+}
+
+// Reads the entry at offset in pack fd.  Its data is left in *data, which
+// the caller frees, if data isn't null.
+int pack_read(int fd, uint64_t offset, uint64_t end, struct pack_entry *entry, unsigned char **data) {
+  unsigned char *buf;
+
+  if(offset + sizeof(*entry) > end ||
+    pread(fd, entry, sizeof(*entry), offset) != sizeof(*entry) ||
+    entry->magic != PACK_MAGIC ||
+    entry->size > end - offset - sizeof(*entry)
+  ) {
+    return 0;
+  }
+
+  if(data) {
+    buf = (unsigned char*) malloc(entry->size + 1);
+    if(pread(fd, buf, entry->size, offset + sizeof(*entry)) != (ssize_t) entry->size ||
+      pack_sum(entry, buf) != entry->sum
+    ) {
+      free(buf);
+      return 0;
+    }
+    *data = buf;
+  }
+
+  return 1;
+}
+
+// Opens whatever packs there are.  This runs before the index is loaded,
+// which then says how much of each is live.
+void pack_open() {
+  DIR *pDir;
+  struct dirent *entry;
+  struct stat st;
+  char name[PATH_MAX];
+  int 
+    fd,
+    id;
+
+  if(!g_idx_slots || g_opts.pack_max <= 0) {
+    g_opts.pack_max = 0;
+    return;
+  }
+
+  mkdirat(g_cache_fd, "packs", 0755);
+  fd = openat(g_cache_fd, "packs", O_RDONLY | O_DIRECTORY);
+  if(fd == -1 || !(pDir = fdopendir(fd))) {
+    fatal("Couldn't open the pack directory");
+  }
+
+  while((entry = readdir(pDir))) {
+    if(sscanf(entry->d_name, "%x.pack", &id) != 1 || id <= 0) {
+      continue;
+    }
+
+    pack_grow(id);
+    pack_name(id, name);
+    g_pack[id].fd = openat(g_cache_fd, name, O_RDWR);
+    if(g_pack[id].fd != -1 && !fstat(g_pack[id].fd, &st)) {
+      g_pack[id].size = st.st_size;
+    }
+  }
+  closedir(pDir);
+
+  plog3("Packing derivatives up to %d bytes", g_opts.pack_max);
+}
+
+// Everything up to the checkpoint is known to be on disk and in the index.
+// Past it, in what was the active pack and any after it, entries are put
+// back in the index and a torn one at the end is cut off.  The last pack
+// is the active one again.
+void pack_recover() {
+  struct pack_entry entry;
+  struct idx_rec cur;
+  unsigned char *data;
+  uint32_t checkpoint[3] = {0};
+  uint64_t offset;
+  int 
+    fd,
+    id,
+    count = 0;
+
+  if(!g_opts.pack_max) {
+    return;
+  }
+
+  fd = openat(g_cache_fd, "packs/checkpoint", O_RDONLY);
+  if(fd != -1) {
+    if(read(fd, checkpoint, sizeof(checkpoint)) != sizeof(checkpoint)) {
+      memset(checkpoint, 0, sizeof(checkpoint));
+    }
+    close(fd);
+  }
+
+  for(id = checkpoint[0] ? checkpoint[0] : 1; id < g_pack_count; id++) {
+    if(g_pack[id].fd == -1) {
+      continue;
+    }
+
+    offset = (uint32_t) id == checkpoint[0] ? 
+      checkpoint[1] | ((uint64_t) checkpoint[2] << 32) : 0;
+
+    while(offset < g_pack[id].size) {
+      if(!pack_read(g_pack[id].fd, offset, g_pack[id].size, &entry, &data)) {
+        plog0("Pack %d is torn at %d, truncating", id, (int) offset);
+        if(ftruncate(g_pack[id].fd, offset)) {
+          plog0("Couldn't truncate pack %d", id);
+        }
+        g_pack[id].size = offset;
+        break;
+      }
+      free(data);
+
+      if(!idx_get(entry.rec.key, &cur) || cur.created < entry.rec.created) {
+        idx_put(&entry.rec);
+        count++;
+      }
+
+      offset += PACK_SPAN(entry.size);
+    }
+  }
+
+  for(id = g_pack_count - 1; id > 0 && g_pack[id].fd == -1; id--);
+  g_pack_active = id > 0 ? id : 0;
+
+  plog1("Recovered %d packed derivatives", count);
+}
+
+// Notes how far the active pack is known to be on disk
+void pack_checkpoint() {
+  uint32_t checkpoint[3];
+  int 
+    fd,
+    ret;
+
+  pthread_mutex_lock(&g_pack_lock);
+  if(!g_pack_active) {
+    pthread_mutex_unlock(&g_pack_lock);
+    return;
+  }
+  checkpoint[0] = g_pack_active;
+  checkpoint[1] = (uint32_t) g_pack[g_pack_active].size;
+  checkpoint[2] = (uint32_t) (g_pack[g_pack_active].size >> 32);
+  fd = dup(g_pack[g_pack_active].fd);
+  pthread_mutex_unlock(&g_pack_lock);
+
+  fdatasync(fd);
+  close(fd);
+
+  fd = openat(g_cache_fd, "packs/checkpoint.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    return;
+  }
+  ret = write(fd, checkpoint, sizeof(checkpoint));
+  fdatasync(fd);
+  close(fd);
+
+  if(ret == sizeof(checkpoint)) {
+    renameat(g_cache_fd, "packs/checkpoint.tmp", g_cache_fd, "packs/checkpoint");
+  }
+}
+
+// Copies what's still live out of a sealed pack into the active one and
+// deletes it.
+void pack_compact(const char *name) {
+  struct pack_entry entry;
+  struct idx_rec to;
+  unsigned char *data;
+  uint64_t 
+    offset = 0,
+    size;
+  int 
+    fd,
+    id,
+    count = 0;
+
+  if(sscanf(name, "packs/%x.pack", &id) != 1) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_pack_lock);
+  if(id <= 0 || id >= g_pack_count || id == g_pack_active || g_pack[id].fd == -1) {
+    pthread_mutex_unlock(&g_pack_lock);
+    return;
+  }
+  fd = dup(g_pack[id].fd);
+  size = g_pack[id].size;
+  pthread_mutex_unlock(&g_pack_lock);
+
+  while(pack_read(fd, offset, size, &entry, 0)) {
+    // idx_move checks this again, after the copy is made
+    if(idx_at(entry.rec.key, id, entry.rec.offset) && pack_read(fd, offset, size, &entry, &data)) {
+      memcpy(&to, &entry.rec, sizeof(to));
+      if(pack_append(&to, data, entry.size) && 
+        idx_move(entry.rec.key, id, entry.rec.offset, &to)
+      ) {
+        count++;
+      }
+      free(data);
+    }
+    offset += PACK_SPAN(entry.size);
+  }
+  close(fd);
+
+  pthread_mutex_lock(&g_pack_lock);
+  close(g_pack[id].fd);
+  g_pack[id].fd = -1;
+  g_pack[id].size = g_pack[id].live = 0;
+  pthread_mutex_unlock(&g_pack_lock);
+
+  unlinkat(g_cache_fd, name, 0);
+  plog1("Compacted %s, kept %d derivatives", name, count);
+}
+
+// Looks for packs worth compacting: sealed ones that are mostly dead
+void pack_maintain() {
+  char name[PATH_MAX];
+  int id;
+
+  if(!g_opts.pack_max) {
+    return;
+  }
+
+  pack_checkpoint();
+
+  for(id = 1; id < g_pack_count; id++) {
+    if(id != g_pack_active && g_pack[id].fd != -1 && g_pack[id].live * 2 < g_pack[id].size) {
+      pack_name(id, name);
+      bg_submit(pack_compact, name, BG_LATER);
+    }
+  }
+}
+
+// Whether the original a derivative was made from, as st found it (or
+// didn't, if it's 0), is still the one it was made from.  If it isn't,
+// the derivative is thrown out.
+char check_for_change(struct idx_rec *rec, const struct stat *st) {
+  if( st &&
+    (uint64_t) st->st_ino == rec->src_ino &&
+    (int64_t) st->st_mtime == rec->src_mtime &&
+    (int64_t) st->st_size == rec->src_size
+  ) {
+    return 1;
+  }
+
+  plog3("Found out of date file %s... removing", rec->key);
+
+  idx_drop(rec->key, rec->src);
+
+  return 0;
+}
+
+// An original changed, or went away: throw out everything made from it,
+// or with tree set, from anything under it.  With stale_while_revalidate,
+// the derivatives of an original that's still there are only marked stale.
+void invalidate(const char *src, int tree) {
+  struct dep 
+    *node,
+    *next;
+
+  int 
+    ix,
+    count,
+    keep;
+
+  for(node = dep_detach(src, tree); node; node = next) {
+    next = node->next;
+    keep = g_opts.swr > 0 && !tree && !access(node->src, R_OK);
+
+    for(count = ix = 0; ix < node->count; ix++) {
+      if(keep) {
+        if(idx_stale(node->keys[ix], node->src)) {
+          dep_add(node->src, node->keys[ix]);
+          count++;
+        }
+      } else if(idx_drop(node->keys[ix], node->src)) {
+        count++;
+      }
+    }
+    plog1("%s changed, %s %d derivatives", node->src, keep ? "staled" : "removed", count);
+    dep_free(node);
+  }
+}
+
+// After a lost inotify event (or a restart) we don't know what changed, so
+// every original that has derivatives is checked once.  Nothing else is.
+// The graph has them by original, so each is stat'ed once and held up
+// against everything made from it.
+void rescan() {
+  struct idx_rec rec;
+  struct stat st;
+  char 
+    **srcs,
+    **keys;
+
+  int 
+    nsrc,
+    nkeys,
+    found,
+    ix,
+    jx,
+    count = 0;
+
+  srcs = dep_list(0, &nsrc);
+  for(ix = 0; ix < nsrc; ix++) {
+    found = !stat(srcs[ix], &st);
+    keys = dep_list(srcs[ix], &nkeys);
+
+    for(jx = 0; jx < nkeys; jx++) {
+      if(idx_peek(keys[jx], &rec) && !check_for_change(&rec, found ? &st : 0)) {
+        count++;
+      }
+      free(keys[jx]);
+    }
+    free(keys);
+    free(srcs[ix]);
+  }
+  free(srcs);
+
+  plog1("Rescan removed %d derivatives", count);
+}
+
+// Opens the derivative for name if it's there.  With an index, only what's
+// in it counts and rec is filled in.  A stale derivative is only good if
+// stale_ok is set, and not past stale_while_revalidate seconds.
+//
+// A derivative in a file of its own can be renamed over by a new version
+// between reading its record and opening it, before the record follows,
+// so its size is the file's and its tag is made from the file too.
+int cache_lookup(const char *name, struct idx_rec *rec, int stale_ok) {
+  char key[PATH_MAX];
+  struct stat st;
+  int fd;
+
+  if(!g_idx) {
+    return cache_open(name);
+  }
+
+  // inotify keeps the index current, see main_loop
+  recipe_key(name, key);
+  if(!idx_get(key, rec)) {
+    return -1;
+  }
+
+  if(rec->stale && (!stale_ok || time(0) - rec->stale > g_opts.swr)) {
+    return -1;
+  }
+
+  fd = rec->pack ? pack_fd(rec) : cache_open(name);
+  if(fd == -1) {
+    idx_drop(key, 0);
+  } else if(!rec->pack) {
+    if(fstat(fd, &st)) {
+      close(fd);
+      return -1;
+    }
+    rec->size = st.st_size;
+    rec->etag = idx_file_etag(rec->etag, &st);
+  }
+  return fd;
+}
+
+// Reads the image at fd and closes it.  If size is set, the image is size
+// bytes at offset in a pack.
+int image_start(MagickWand *wand, int fd, uint64_t offset, size_t size) {
+  MagickBooleanType stat;
+  FILE *fdesc;
+  unsigned char *buf;
+
+  if(size) {
+    buf = (unsigned char*) malloc(size);
+    stat = pread(fd, buf, size, offset) == (ssize_t) size ? 
+      MagickReadImageBlob(wand, buf, size) : MagickFalse;
+    free(buf);
+    close(fd);
+  } else {
+    fdesc = fdopen(fd, "rb");
+    stat = MagickReadImageFile(wand, fdesc);
+    fclose(fdesc);
+  }
+
+  if (stat == MagickFalse) {
+    return 0;
+  }
+
+  MagickResetIterator(wand);
+
+  while (MagickNextImage(wand) != MagickFalse);
+
+  return 1;
+}
+
+unsigned char* image_end(MagickWand *wand, const char *format, size_t *sz) {
+  MagickSetImageFormat(wand, format);
+  return MagickGetImageBlob(wand, sz);
+}
+
+int image_offset(MagickWand *wand, char*ptr){
+  int 
+    offsetY, 
+    offsetX, 
+    height, 
+    width;
+
+  height = atoi_ptr(&ptr);
+  if(!ASSERT_CHAR(ptr, 'x')) {
+    plog0("%s\n", ptr);
+    return 0;
+  }
+  width = atoi_ptr(&ptr);
+
+  offsetY = atoi_ptr(&ptr);
+  offsetX = atoi_ptr(&ptr);
+
+  return MagickCropImage(wand, width, height, offsetX, offsetY);
+}
+
+int image_quality(MagickWand *wand, char*ptr) {
+  int quality = atoi(ptr);
+
+  return MagickSetImageCompressionQuality(wand, quality);
+}
+
+int image_resize(MagickWand *wand, char*ptr) {
+  char *last;
+
+  int 
+    height = -1, 
+    width = -1;
+
+  for(last = ptr;;ptr++) {
+    if(ptr[0] >= '0' && ptr[0] <= '9') {
+      continue;
+    }
+    if(ptr[0] == 'x') {
+      ptr[0] = 0;
+      height = atoi(last);
+      ptr[0] = 'x';
+      last = ptr + 1;
+      continue;
+    }
+    if(ptr[0] <= 32) {
+      width = atoi(last);
+      if(height == -1) {
+        height = width;
+      }
+      ptr++;
+      break;
+    }
+  }
+
+  plog3("Proportion %d", g_opts.proportion);
+  /*
+  if(g_opts.proportion ==
+  MagickLiquidRescaleImage
+  */
+  MagickResizeImage(
+    wand,
+    height,
+    width,
+    LanczosFilter,
+    1.0
+  );
+
+  return 1;
+}
+
+// What one output pixel of a resize is made of, on one side
+struct taps {
+  int 
+    start,
+    count;
+
+  float *weight;
+};
+
+// Lanczos: a sinc windowed by a sinc 3 times as wide
+double lanczos(double x) {
+  if(x < 0) {
+    x = -x;
+  }
+  if(x < 1e-6) {
+    return 1.0;
+  }
+  if(x >= 3.0) {
+    return 0.0;
+  }
+  return sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x / 3.0);
+}
+
+// The taps of output pixels from to from + count of a resize from in to
+// out, weighed the way MagickResizeImage does with LanczosFilter.  Returns
+// 0 if there's no memory for them.
+struct taps *region_taps(int in, int out, int from, int count) {
+  struct taps *taps;
+  double 
+    factor = (double) out / in,
+    scale = 1.0 / factor > 1.0 ? 1.0 / factor : 1.0,
+    support = 3.0 * scale,
+    center,
+    density;
+
+  int 
+    most = (int) (2.0 * support) + 3,
+    ix,
+    it;
+
+  taps = (struct taps*) malloc(count * (sizeof(struct taps) + most * sizeof(float)));
+  if(!taps) {
+    return 0;
+  }
+
+  for(ix = 0; ix < count; ix++) {
+    center = (from + ix + 0.5) / factor;
+    taps[ix].weight = (float*) (taps + count) + ix * most;
+    taps[ix].start = center - support + 0.5 > 0 ? (int) (center - support + 0.5) : 0;
+    taps[ix].count = (center + support + 0.5 < in ? (int) (center + support + 0.5) : in) - taps[ix].start;
+    if(taps[ix].count > most) {
+      taps[ix].count = most;
+    }
+
+    density = 0;
+    for(it = 0; it < taps[ix].count; it++) {
+      taps[ix].weight[it] = lanczos((taps[ix].start + it - center + 0.5) / scale);
+      density += taps[ix].weight[it];
+    }
+    for(it = 0; density != 0 && it < taps[ix].count; it++) {
+      taps[ix].weight[it] /= density;
+    }
+  }
+  return taps;
+}
+
+// One pass of the resample, over count pixels that are stride floats apart
+// in each of lines lines of src, into out.  With alpha, the colours are
+// weighed by it.
+void region_pass(const float *src, int src_line, int stride, struct taps *taps, int count, int lines, int channels, float *out, int out_line, int out_stride) {
+  const float *pixel;
+  double 
+    sum[4],
+    alpha,
+    w;
+
+  int 
+    line,
+    ix,
+    it,
+    ic;
+
+  for(line = 0; line < lines; line++) {
+    for(ix = 0; ix < count; ix++) {
+      sum[0] = sum[1] = sum[2] = sum[3] = alpha = 0;
+      for(it = 0; it < taps[ix].count; it++) {
+        pixel = src + line * src_line + (taps[ix].start + it) * stride;
+        w = taps[ix].weight[it];
+        if(channels == 4) {
+          sum[3] += w * pixel[3];
+          w *= pixel[3];
+          alpha += w;
+        }
+        for(ic = 0; ic < 3; ic++) {
+          sum[ic] += w * pixel[ic];
+        }
+      }
+      if(channels == 4) {
+        alpha = fabs(alpha) > 1e-12 ? 1.0 / alpha : 0;
+        sum[0] *= alpha;
+        sum[1] *= alpha;
+        sum[2] *= alpha;
+      }
+      for(ic = 0; ic < channels; ic++) {
+        out[line * out_line + ix * out_stride + ic] = 
+          sum[ic] < 0 ? 0 : sum[ic] > 1 ? 1 : sum[ic];
+      }
+    }
+  }
+}
+
+// The crop_width by crop_height at x, y of a resize to width by height,
+// made at once: only the pixels of the crop are resampled, from just the
+// part of the image under them.  Returns 0, with the image as it was, if
+// it isn't RGB or gray or there's no memory for it.
+int region_resample(MagickWand *wand, int width, int height, int crop_width, int crop_height, int x, int y) {
+  struct taps 
+    *across = 0,
+    *down = 0;
+
+  float 
+    *src = 0,
+    *mid = 0,
+    *out = 0;
+
+  MagickWand *clone;
+  ColorspaceType colorspace = MagickGetImageColorspace(wand);
+  int 
+    in_width = MagickGetImageWidth(wand),
+    in_height = MagickGetImageHeight(wand),
+    channels = MagickGetImageAlphaChannel(wand) ? 4 : 3,
+    sx0,
+    sx1,
+    sy0,
+    sy1,
+    ret = 0;
+
+  if(colorspace == sRGBColorspace || colorspace == RGBColorspace || colorspace == GRAYColorspace) {
+    across = region_taps(in_width, width, x, crop_width);
+    down = region_taps(in_height, height, y, crop_height);
+  }
+
+  if(across && down) {
+    sx0 = across[0].start;
+    sx1 = across[crop_width - 1].start + across[crop_width - 1].count;
+    sy0 = down[0].start;
+    sy1 = down[crop_height - 1].start + down[crop_height - 1].count;
+    for(ret = 0; ret < crop_width; ret++) {
+      across[ret].start -= sx0;
+    }
+    for(ret = 0; ret < crop_height; ret++) {
+      down[ret].start -= sy0;
+    }
+    ret = 0;
+
+    src = (float*) malloc(sizeof(float) * channels * (sx1 - sx0) * (sy1 - sy0));
+    mid = (float*) malloc(sizeof(float) * channels * crop_width * (sy1 - sy0));
+    out = (float*) malloc(sizeof(float) * channels * crop_width * crop_height);
+  }
+
+  if(out && mid && src && 
+    MagickExportImagePixels(wand, sx0, sy0, sx1 - sx0, sy1 - sy0, 
+      channels == 4 ? "RGBA" : "RGB", FloatPixel, src) != MagickFalse
+  ) {
+    // across each row, then down each column of that
+    region_pass(src, channels * (sx1 - sx0), channels, across, crop_width, sy1 - sy0, channels, 
+      mid, channels * crop_width, channels);
+    region_pass(mid, channels, channels * crop_width, down, crop_height, crop_width, channels, 
+      out, channels, channels * crop_width);
+
+    // The image keeps everything but its pixels.  They go into a copy,
+    // which only replaces it once they're all there.
+    clone = CloneMagickWand(wand);
+    ret = MagickSampleImage(clone, crop_width, crop_height) != MagickFalse &&
+      MagickImportImagePixels(clone, 0, 0, crop_width, crop_height, 
+        channels == 4 ? "RGBA" : "RGB", FloatPixel, out) != MagickFalse &&
+      MagickAddImage(wand, clone) != MagickFalse;
+    if(ret) {
+      MagickSetIteratorIndex(wand, 0);
+      MagickRemoveImage(wand);
+    }
+    DestroyMagickWand(clone);
+  }
+
+  free(across);
+  free(down);
+  free(src);
+  free(mid);
+  free(out);
+
+  return ret;
+}
+
+int gcd(int a, int b) {
+  int t;
+
+  while(b) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// One side of image_region: the part of the in pixels resized to out that
+// [*from, *to) of out needs, which is [*src_from, *src_to), and where that
+// part starts and ends once it's resized, back in *from and *to
+void region_side(int in, int out, int *from, int *to, int *src_from, int *src_to) {
+  int 
+    unit = in / gcd(in, out),
+    reach;
+
+  // the resize filter reaches 3 pixels, or 3 output pixels when shrinking,
+  // each way, and the part has to start and end on whole output pixels
+  reach = in > out ? (3 * in + out - 1) / out + 1 : 4;
+
+  *src_from = (int) ((int64_t) *from * in / out) - reach;
+  *src_to = (int) (((int64_t) *to * in + out - 1) / out) + reach;
+  *src_from = *src_from > 0 ? *src_from / unit * unit : 0;
+  *src_to = *src_to < in ? (*src_to + unit - 1) / unit * unit : in;
+  if(*src_to > in) {
+    *src_to = in;
+  }
+
+  *from = (int) ((int64_t) *src_from * out / in);
+  *to = (int) ((int64_t) *src_to * out / in);
+}
+
+// A resize to AxB and the crop HxWpYpX after it, which the planner has
+// put inside the image.  If the part of the image under the crop, plus
+// the filter's reach around it, is at most half of it, that part is cut
+// out, resized and trimmed, with the same pixels as resizing everything.
+// Otherwise a crop of at most a quarter of the resize is made by
+// region_resample, and anything else is resized and cropped as usual.
+//
+// A crop is placed on the image's canvas, which a resize scales, so the
+// part is moved to the corner of a canvas of its own, where the trim is
+// at pixel offsets.  Either way the image ends on the canvas that
+// resizing and cropping would have left it on.
+int image_region(MagickWand *wand, char*ptr) {
+  size_t 
+    page_width,
+    page_height;
+
+  ssize_t 
+    page_x,
+    page_y;
+
+  int 
+    in_width = MagickGetImageWidth(wand),
+    in_height = MagickGetImageHeight(wand),
+    width,
+    height,
+    crop_width,
+    crop_height,
+    x,
+    y,
+    x0,
+    x1,
+    y0,
+    y1,
+    sx0,
+    sx1,
+    sy0,
+    sy1,
+    ret = 0;
+
+  if(sscanf(ptr, "%dx%do%dx%dp%dp%d", &width, &height, &crop_height, &crop_width, &y, &x) != 6) {
+    return 0;
+  }
+  MagickGetImagePage(wand, &page_width, &page_height, &page_x, &page_y);
+
+  x0 = x;
+  x1 = x + crop_width;
+  y0 = y;
+  y1 = y + crop_height;
+  region_side(in_width, width, &x0, &x1, &sx0, &sx1);
+  region_side(in_height, height, &y0, &y1, &sy0, &sy1);
+
+  if((int64_t) (sx1 - sx0) * (sy1 - sy0) * 2 <= (int64_t) in_width * in_height) {
+    ret = MagickCropImage(wand, sx1 - sx0, sy1 - sy0, sx0, sy0) != MagickFalse &&
+      MagickSetImagePage(wand, 0, 0, 0, 0) != MagickFalse &&
+      MagickResizeImage(wand, x1 - x0, y1 - y0, LanczosFilter, 1.0) != MagickFalse &&
+      MagickCropImage(wand, crop_width, crop_height, x - x0, y - y0) != MagickFalse;
+  } else if((int64_t) crop_width * crop_height * 4 <= (int64_t) width * height) {
+    ret = region_resample(wand, width, height, crop_width, crop_height, x, y);
+  }
+
+  if(!ret) {
+    MagickResizeImage(wand, width, height, LanczosFilter, 1.0);
+    return MagickCropImage(wand, crop_width, crop_height, x, y);
+  }
+  MagickSetImagePage(wand, 
+    (size_t) ((double) page_width * width / in_width + 0.5), 
+    (size_t) ((double) page_height * height / in_height + 0.5), 
+    page_x + x, 
+    page_y + y
+  );
+  return ret;
+}
+
+// An original, or a derivative next to it, that find_base tries
+int base_open(const char *fname) {
+  int fd = open(fname, O_RDONLY);
+
+  PROBE2(open, fname, fd);
+  return fd;
+}
+
+// Looks for the request in the cache and in img_root, backing up one
+// directive at a time until something exists.  The directives peeled off
+// the end of name are pushed onto commandList, rightmost first, and the
+// name of whatever was opened is left in fname.  If that was a derivative
+// from the index, rec is its record, otherwise rec->flags is 0.  Only the
+// request itself may be stale, and only if stale_ok is set; nothing is
+// ever made from a stale derivative.
+int find_base(char *name, char **commandList, int *count, char *fname, struct idx_rec *rec, int stale_ok) {
+  int 
+    fd,
+    formatIndex,
+    formatOffset;
+
+  char 
+    *last,
+    *ext;
+
+  *count = 0;
+  rec->flags = 0;
+
+  // first we try to just blindly open the requested file
+  strcpy(fname, name);
+  if((fd = cache_lookup(fname, rec, stale_ok)) != -1) {
+    return fd;
+  }
+  // a stale derivative isn't an original either
+  if(!rec->flags && (g_cache_fd != AT_FDCWD || g_idx) && (fd = base_open(fname)) != -1) {
+    return fd;
+  }
+  rec->flags = 0;
+
+  // get the extension
+  for(last = name + strlen(name); (last > name) && (*last != '.'); last--);
+  if(last[0] != '.') {
+    return -1;
+  }
+  last[0] = 0;
+  ext = last + 1;
+
+  while(*count < MAX_DIRECTIVES) {
+    // find the next clause to try to dump
+    for(; (last > name) && (*last != '_'); last--);
+
+    // we must give up eventually
+    if(last[0] != '_') {
+      break;
+    }
+    last[0] = 0;
+
+    // add this as a command
+    commandList[(*count)++] = last + 1;
+
+    sprintf(fname, "%s.%s", name, ext);
+    if((fd = cache_lookup(fname, rec, 0)) != -1) {
+      return fd;
+    }
+    if(!rec->flags && (g_cache_fd != AT_FDCWD || g_idx) && (fd = base_open(fname)) != -1) {
+      return fd;
+    }
+    rec->flags = 0;
+
+    // FALLBACKS
+    // Find the index in the check if any.
+    for(formatIndex = 0; formatCheck[formatIndex].extension; formatIndex++) {
+      if (!strcmp(ext, formatCheck[formatIndex].extension)) {
+        break;
+      }
+    }
+
+    if (!formatCheck[formatIndex].extension) {
+      continue;
+    }
+
+    for(
+      formatOffset = 0;
+      formatCheck[formatIndex].fallbacks[formatOffset];
+      formatOffset++
+    ) {
+      sprintf(fname, "%s.%s", name, formatCheck[formatIndex].fallbacks[formatOffset]);
+      if((fd = base_open(fname)) != -1) {
+        return fd;
+      }
+    }
+  }
+
+  return -1;
+}
+
+// Decodes the image open at fd, named fname, for derive_end.  fd is
+// closed.  Unless rec is a derivative from the index, fname is taken as
+// its source.  Returns 0 if fd can't be read.
+MagickWand *derive_start(int fd, const char *fname, struct idx_rec *rec) {
+  struct stat st;
+  MagickWand *wand;
+  uint64_t offset = 0;
+  size_t size = 0;
+  struct pmu_read pmu;
+  int64_t start;
+
+  // what we make depends on the original under whatever we started from
+  if(!rec->flags) {
+    if(fstat(fd, &st)) {
+      close(fd);
+      return 0;
+    }
+    strncpy(rec->src, fname, IDX_KEYLEN - 1);
+    rec->src[IDX_KEYLEN - 1] = 0;
+    rec->src_ino = st.st_ino;
+    rec->src_mtime = st.st_mtime;
+    rec->src_size = st.st_size;
+  }
+
+  // a packed base is only part of its file
+  if(rec->flags && rec->pack) {
+    offset = rec->offset;
+    size = rec->size;
+  }
+
+  wand = NewMagickWand();
+  PROBE1(decode__start, fname);
+  if(g_opts.perf_counters) {
+    pmu_sample(&pmu);
+  }
+  start = now_us();
+  image_start(wand, fd, offset, size);
+  stat_time(ST_DECODE, now_us() - start);
+
+  t_req.width = MagickGetImageWidth(wand);
+  t_req.height = MagickGetImageHeight(wand);
+  PROBE3(decode__done, fname, t_req.width, t_req.height);
+  if(g_opts.slow_ms || g_opts.perf_counters) {
+    trace_source(wand);
+  }
+  if(g_opts.perf_counters) {
+    pmu_add(ST_DECODE, &pmu);
+  }
+  return wand;
+}
+
+// Puts image, made from fname, in the cache as name, and makes rec its
+// record.  If link is set, image is that original as it is, and name is
+// made a hard link to it where it can be.
+void derive_commit(const unsigned char *image, size_t sz, const char *fname, const char *name, struct idx_rec *rec, const char *link) {
+  struct stat st;
+  int64_t start;
+
+  recipe_key(name, rec->key);
+  rec->size = sz;
+  rec->created = rec->atime = time(0);
+  rec->stale = 0;
+  rec->etag = idx_etag(rec);
+  rec->flags = IDX_LIVE;
+
+  // Only save the file unless disk is set to false.  Without a record it
+  // couldn't be checked, so names too long for one aren't kept.
+  if (g_opts.b_disk && (!g_idx || (
+      strlen(rec->key) < IDX_KEYLEN - 1 && strlen(fname) < IDX_KEYLEN - 1
+    ))
+  ) {
+    rec->pack = 0;
+    rec->offset = 0;
+
+    PROBE2(write__start, name, (long long) sz);
+    start = now_us();
+    if((sz <= (size_t) g_opts.pack_max ? pack_append(rec, image, sz) : 
+        (link && cache_link(link, name)) || cache_commit(name, image, sz, &st)
+      ) && g_idx
+    ) {
+      idx_put(rec);
+
+      // served with the tag a lookup will give it
+      if(!rec->pack) {
+        rec->etag = idx_file_etag(rec->etag, &st);
+      }
+    }
+    stat_time(ST_WRITE, now_us() - start);
+    PROBE1(write__done, name);
+  }
+
+  plog2("%s", name);
+}
+
+// Chain prefixes
+//
+// photo_r1000x1000_o250x250p250p250.png is made by resizing photo.png to
+// 1000x1000 and cropping that, and every other crop of the same resize
+// does the resize again.  Each time a resize that more directives follow
+// is done, its prefix, photo_r1000x1000.png, is counted, and once it's
+// been done prefix_keep times it's encoded and kept as a derivative of its
+// own.  find_base tries the longest prefix first, so the crops after that
+// start from it.  Prefixes are only known by their hash: a collision just
+// keeps one early.
+#define PREFIX_SLOTS  4096
+#define PREFIX_PROBE  8
+
+struct prefix {
+  volatile uint64_t hash;
+  volatile int count;
+};
+
+struct prefix g_prefixes[PREFIX_SLOTS];
+pthread_mutex_t g_prefix_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counts another making of prefix and returns how many there have been
+int prefix_seen(const char *prefix) {
+  struct prefix 
+    *slot,
+    *pick = 0;
+
+  // 0 is an empty slot
+  uint64_t hash = hash_str(prefix) | 1;
+  int 
+    count,
+    ix;
+
+  for(ix = 0; ix < PREFIX_PROBE; ix++) {
+    slot = &g_prefixes[(hash + ix) % PREFIX_SLOTS];
+    if(slot->hash == hash) {
+      return __sync_add_and_fetch(&slot->count, 1);
+    }
+  }
+
+  // it takes the place of the least made one near it
+  pthread_mutex_lock(&g_prefix_lock);
+  for(ix = 0; ix < PREFIX_PROBE; ix++) {
+    slot = &g_prefixes[(hash + ix) % PREFIX_SLOTS];
+    if(slot->hash == hash) {
+      break;
+    }
+    if(!pick || slot->count < pick->count) {
+      pick = slot;
+    }
+  }
+  if(ix == PREFIX_PROBE) {
+    slot = pick;
+    slot->count = 0;
+    slot->hash = hash;
+  }
+  count = __sync_add_and_fetch(&slot->count, 1);
+  pthread_mutex_unlock(&g_prefix_lock);
+
+  return count;
+}
+
+// wand has had all but the last left directives of name done to it.  If
+// that's been done often enough, it's kept as what it is, which is name
+// without those directives.
+void prefix_save(MagickWand *wand, const char *fname, const char *name, int left, struct idx_rec *rec) {
+  char 
+    prefix[PATH_MAX],
+    *ext,
+    *cut;
+
+  unsigned char *image;
+  struct idx_rec out;
+  MagickWand *copy;
+  size_t sz;
+
+  snprintf(prefix, PATH_MAX, "%s", name);
+  if(!(ext = strrchr(prefix, '.'))) {
+    return;
+  }
+  for(cut = ext; left; left--) {
+    for(cut--; cut > prefix && *cut != '_'; cut--);
+  }
+  memmove(cut, ext, strlen(ext) + 1);
+
+  if(prefix_seen(prefix) < g_opts.prefix_keep) {
+    return;
+  }
+
+  copy = CloneMagickWand(wand);
+  image = image_end(copy, cut + 1, &sz);
+  DestroyMagickWand(copy);
+  if(image) {
+    memcpy(&out, rec, sizeof(out));
+    derive_commit(image, sz, fname, prefix, &out, 0);
+    MagickRelinquishMemory(image);
+    stat_count(C_PREFIX, 1);
+    plog1("Kept %s", prefix);
+  }
+}
+
+// Plans
+//
+// The directives of a recipe are done in order, but not all of them need
+// doing.  Before anything is resampled they're planned against the size
+// of the decoded image:
+//
+//  * a resize to the size the image already is, or a crop of all of it,
+//    is dropped, as is a quality for a format that has none (GIF, BMP)
+//  * a resize straight after a resize replaces it, so the image is only
+//    resampled once
+//  * a crop straight after a resize becomes a region, see image_region,
+//    so only the pixels that are kept, and a few around them, are
+//    resampled
+//
+// A crop is placed on the image's canvas, not at pixel offsets, so what a
+// second one cuts depends on the first.  Recipes with more than one crop,
+// or images that aren't at the corner of their canvas, are done as they
+// were asked for, as is anything else that isn't understood.  A plan with
+// nothing left, to the original's format, is the original itself, so
+// that's what's served.
+#define PLAN_MAX      MAX_DIRECTIVES
+#define PLAN_LEN      48
+
+struct step {
+  char type;
+
+  // a resize is to width by height and a crop is width by height at x, y;
+  // a region is that crop of a resize to to_width by to_height.  A quality
+  // is in width.
+  int 
+    width,
+    height,
+    x,
+    y,
+    to_width,
+    to_height,
+    in_width,
+    in_height;
+
+  // directives still to do after this one, or -1 if what it makes isn't
+  // any prefix of the recipe, see prefix_save
+  int left;
+};
+
+// Reads directive into step.  Returns 0 if it's not one the plan knows
+// how to read.
+int plan_parse(char *directive, struct step *step) {
+  char *end;
+
+  memset(step, 0, sizeof(*step));
+  step->type = directive[0];
+  switch(step->type) {
+    // NOP
+    case 0:
+      return 1;
+
+    case D_RESIZE:
+      step->width = step->height = strtol(directive + 1, &end, 10);
+      if(end[0] == 'x') {
+        step->height = strtol(end + 1, &end, 10);
+      }
+      return !end[0] && step->width > 0 && step->height > 0;
+
+    case D_OFFSET:
+      end = directive + 1;
+      step->height = atoi_ptr(&end);
+      if(!ASSERT_CHAR(end, 'x')) {
+        return 0;
+      }
+      step->width = atoi_ptr(&end);
+      step->y = atoi_ptr(&end);
+      step->x = atoi_ptr(&end);
+      return !end[0] && step->width > 0 && step->height > 0;
+
+    case D_QUALITY:
+      step->width = strtol(directive + 1, &end, 10);
+      return !end[0];
+  }
+  return 0;
+}
+
+// Plans the directives in commandList, last first, for wand, to be made
+// into format.  plan gets what to do, in order, as directives, and left
+// the same as step's.  Returns how many there are.
+int plan_make(MagickWand *wand, char **commandList, int count, const char *format, char (*plan)[PLAN_LEN], int *left) {
+  struct step 
+    steps[PLAN_MAX],
+    step,
+    *last;
+
+  char **pTmp;
+  size_t 
+    page_width,
+    page_height;
+
+  ssize_t 
+    page_x,
+    page_y;
+
+  int 
+    width = MagickGetImageWidth(wand),
+    height = MagickGetImageHeight(wand),
+    crops = 0,
+    x1,
+    y1,
+    n = 0,
+    ix;
+
+  for(pTmp = commandList; pTmp < commandList + count; pTmp++) {
+    crops += (*pTmp)[0] == D_OFFSET;
+  }
+  MagickGetImagePage(wand, &page_width, &page_height, &page_x, &page_y);
+
+  // frames are resized and cropped one at a time
+  if(MagickGetNumberImages(wand) != 1 || crops > 1 || page_x || page_y) {
+    n = -1;
+  }
+
+  for(pTmp = commandList + count - 1; n != -1 && pTmp >= commandList; pTmp--) {
+    if(!plan_parse(*pTmp, &step)) {
+      n = -1;
+      break;
+    }
+    step.left = pTmp - commandList;
+    step.in_width = width;
+    step.in_height = height;
+    last = n ? &steps[n - 1] : 0;
+
+    switch(step.type) {
+      case D_QUALITY:
+        if(strcasecmp(format, "gif") && strcasecmp(format, "bmp")) {
+          steps[n++] = step;
+        }
+        break;
+
+      case D_RESIZE:
+        if(last && last->type == D_RESIZE) {
+          step.in_width = last->in_width;
+          step.in_height = last->in_height;
+          step.left = -1;
+          n--;
+        }
+        if(step.width != step.in_width || step.height != step.in_height) {
+          steps[n++] = step;
+        }
+        width = step.width;
+        height = step.height;
+        break;
+
+      case D_OFFSET:
+        // what's left of it inside the image; one that starts outside it
+        // is left where it's asked to be on the canvas
+        x1 = step.x + step.width < width ? step.x + step.width : width;
+        y1 = step.y + step.height < height ? step.y + step.height : height;
+        if(step.x < 0 || step.y < 0 || x1 <= step.x || y1 <= step.y) {
+          n = -1;
+          break;
+        }
+        step.width = x1 - step.x;
+        step.height = y1 - step.y;
+        width = step.width;
+        height = step.height;
 
-  MagickWand *wand = NewMagickWand();
-  
-  // first we try to just blindly open the requested file
-  ptr = request_info->uri + 1;
-  
-  strcpy(fname, ptr);
-  strcpy(butcher, ptr);
+        if(step.width == step.in_width && step.height == step.in_height) {
+          break;
+        }
+        if(last && last->type == D_RESIZE) {
+          last->type = D_REGION;
+          last->to_width = last->width;
+          last->to_height = last->height;
+          last->width = step.width;
+          last->height = step.height;
+          last->x = step.x;
+          last->y = step.y;
+          last->left = -1;
+        } else {
+          steps[n++] = step;
+        }
+        break;
+    }
+  }
+
+  // as it was asked for, though a region can't be
+  if(n == -1) {
+    for(n = 0, pTmp = commandList + count - 1; pTmp >= commandList; pTmp--, n++) {
+      snprintf(plan[n], PLAN_LEN, "%s", (*pTmp)[0] == D_REGION ? "?" : *pTmp);
+      left[n] = pTmp - commandList;
+    }
+    return n;
+  }
+
+  for(ix = 0; ix < n; ix++) {
+    switch(steps[ix].type) {
+      case D_RESIZE:
+        snprintf(plan[ix], PLAN_LEN, "%c%dx%d", D_RESIZE, steps[ix].width, steps[ix].height);
+        break;
+
+      case D_OFFSET:
+        snprintf(plan[ix], PLAN_LEN, "%c%dx%dp%dp%d", D_OFFSET, 
+          steps[ix].height, steps[ix].width, steps[ix].y, steps[ix].x);
+        break;
+
+      case D_QUALITY:
+        snprintf(plan[ix], PLAN_LEN, "%c%d", D_QUALITY, steps[ix].width);
+        break;
+
+      case D_REGION:
+        snprintf(plan[ix], PLAN_LEN, "%c%dx%d%c%dx%dp%dp%d", D_REGION, 
+          steps[ix].to_width, steps[ix].to_height, D_OFFSET,
+          steps[ix].height, steps[ix].width, steps[ix].y, steps[ix].x);
+        break;
+    }
+    left[ix] = steps[ix].left;
+  }
+  return n;
+}
+
+// The bytes of the original fname, for a plan with nothing to do to it,
+// or 0 if it's not in the format it's asked for in
+unsigned char *plan_original(const char *fname, const char *name, size_t *sz) {
+  const char 
+    *from = strrchr(fname, '.'),
+    *to = strrchr(name, '.');
+
+  unsigned char *image;
+  struct stat st;
+  ssize_t ret;
+  size_t got;
+  int fd;
+
+  if(!from || !to || strcasecmp(
+      strcasecmp(from, ".jpeg") ? from : ".jpg", 
+      strcasecmp(to, ".jpeg") ? to : ".jpg"
+    )
+  ) {
+    return 0;
+  }
+
+  if((fd = base_open(fname)) == -1) {
+    return 0;
+  }
+  if(fstat(fd, &st) || !(image = (unsigned char*) AcquireMagickMemory(st.st_size))) {
+    close(fd);
+    return 0;
+  }
+  for(got = 0; got < (size_t) st.st_size; got += ret) {
+    if((ret = read(fd, image + got, st.st_size - got)) <= 0) {
+      break;
+    }
+  }
+  close(fd);
+
+  if(got < (size_t) st.st_size) {
+    MagickRelinquishMemory(image);
+    return 0;
+  }
+  *sz = got;
+  return image;
+}
+
+// Does one directive of a plan to wand.  Returns the stage it's timed
+// under, or -1.
+int image_directive(MagickWand *wand, char *directive) {
+  switch(directive[0]) {
+    case D_RESIZE:
+      image_resize(wand, directive + 1);
+      return ST_RESIZE;
+
+    case D_OFFSET:
+      image_offset(wand, directive + 1);
+      return ST_CROP;
+
+    case D_REGION:
+      image_region(wand, directive + 1);
+      return ST_RESIZE;
+
+    case D_QUALITY:
+      image_quality(wand, directive + 1);
+      return ST_QUALITY;
+
+    // NOP
+    case 0:
+      return -1;
+  }
+  plog2("Unknown directive: %s", directive);
+  return -1;
+}
+
+// Runs the directives in commandList, as planned, over what derive_start
+// decoded from fname, which it destroys, and puts the result in the cache
+// as name.  rec comes back as the record of the new derivative.
+unsigned char *derive_end(
+    MagickWand *wand,
+    const char *fname, 
+    char **commandList, 
+    int count, 
+    const char *name, 
+    struct idx_rec *rec, 
+    size_t *sz
+  ) {
+
+  char plan[PLAN_MAX][PLAN_LEN];
+  unsigned char *image;
+  struct pmu_read pmu;
+  int64_t start;
+  int 
+    left[PLAN_MAX],
+    steps,
+    stage,
+    ix;
+
+  steps = plan_make(wand, commandList, count, strrchr(name, '.') + 1, plan, left);
+
+  // Nothing to do: the original is what was asked for.  With an index a
+  // derivative is served at the size in its record, so it can't be a link
+  // to an original that might be rewritten under it.
+  if(!steps && !rec->flags && (image = plan_original(fname, name, sz))) {
+    DestroyMagickWand(wand);
+    derive_commit(image, *sz, fname, name, rec, g_idx ? 0 : fname);
+    return image;
+  }
+
+  for(ix = 0; ix < steps; ix++) {
+    // plog3("Command: [%s]", plan[ix]);
+    PROBE1(directive__start, plan[ix]);
+    if(g_opts.perf_counters) {
+      pmu_sample(&pmu);
+    }
+    start = now_us();
+    stage = image_directive(wand, plan[ix]);
+
+    if(stage != -1) {
+      stat_time(stage, now_us() - start);
+      if(g_opts.perf_counters) {
+        pmu_add(stage, &pmu);
+      }
+    }
+    if(g_opts.slow_ms) {
+      trace_step(wand, plan[ix], now_us() - start);
+    }
+    PROBE1(directive__done, plan[ix]);
+
+    if(g_opts.prefix_keep && g_opts.b_disk && stage == ST_RESIZE && left[ix] > 0) {
+      prefix_save(wand, fname, name, left[ix], rec);
+    }
+  }
+  PROBE1(encode__start, name);
+  if(g_opts.perf_counters) {
+    pmu_sample(&pmu);
+  }
+  start = now_us();
+  image = image_end(wand, strrchr(name, '.') + 1, sz);
+  stat_time(ST_ENCODE, now_us() - start);
+  if(g_opts.perf_counters) {
+    pmu_add(ST_ENCODE, &pmu);
+  }
+  PROBE2(encode__done, name, image ? (long long) *sz : -1LL);
+  DestroyMagickWand(wand);
+
+  if(image) {
+    derive_commit(image, *sz, fname, name, rec, 0);
+  }
+  return image;
+}
+
+// Reads the AxB (or A) of a resize directive that ends the recipe
+int resize_dims(const char *ptr, int *a, int *b) {
+  char *end;
+
+  *a = *b = strtol(ptr, &end, 10);
+  if(end[0] == 'x') {
+    *b = strtol(end + 1, &end, 10);
+  }
+  return end[0] == '.' && *a > 0 && *b > 0;
+}
+
+// Sets of derivatives
+//
+// A miss can make more than was asked for from the one decode: a whole
+// srcset family, or the tiles around one of a grid.  Each member is a
+// copy of the source that's cropped (if crop is set) and encoded on a few
+// threads at once, and then they're all committed together.
+struct member {
+  MagickWand *wand;
+  unsigned char *image;
+  const char *format;
+  size_t sz;
+
+  int64_t 
+    crop_us,
+    encode_us;
+
+  // the requested one is made even if it's already there
+  int asked;
+
+  char 
+    crop[64],
+    name[PATH_MAX];
+};
+
+struct member_set {
+  struct member *members;
+  int count;
+  volatile int next;
+};
+
+void *members_thread(void *arg) {
+  struct member_set *set = (struct member_set*) arg;
+  struct member *member;
+  int64_t start;
+  int ix;
+
+  while((ix = __sync_fetch_and_add(&set->next, 1)) < set->count) {
+    member = &set->members[ix];
+    if(member->crop[0]) {
+      start = now_us();
+      image_offset(member->wand, member->crop);
+      member->crop_us = now_us() - start;
+    }
+    start = now_us();
+    member->image = image_end(member->wand, member->format, &member->sz);
+    member->encode_us = now_us() - start;
+  }
+  return 0;
+}
+
+// Makes the members on up to a thread a core, this one included
+void members_make(struct member *members, int count) {
+  static int cores = 0;
+
+  struct member_set set = { members, count, 0 };
+  pthread_t threads[MEMBER_THREADS];
+  int 
+    started,
+    ix;
+
+  if(!cores) {
+    cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    cores = cores < 1 ? 1 : cores > MEMBER_THREADS ? MEMBER_THREADS : cores;
+  }
+
+  for(started = 0; started < cores - 1 && started < count - 1; started++) {
+    if(pthread_create(&threads[started], 0, members_thread, &set)) {
+      break;
+    }
+  }
+  members_thread(&set);
+  for(ix = 0; ix < started; ix++) {
+    pthread_join(threads[ix], 0);
+  }
+
+  for(ix = 0; ix < count; ix++) {
+    if(members[ix].crop[0]) {
+      stat_time(ST_CROP, members[ix].crop_us);
+    }
+    stat_time(ST_ENCODE, members[ix].encode_us);
+  }
+}
+
+// Commits what was made, from fname with rec as its source, and frees the
+// rest.  Returns the requested one, with rec as its record.
+unsigned char *members_commit(struct member *members, int count, const char *fname, struct idx_rec *rec, size_t *sz) {
+  unsigned char *image = 0;
+  struct idx_rec out;
+  int ix;
+
+  for(ix = 0; ix < count; ix++) {
+    if(members[ix].image) {
+      memcpy(&out, rec, sizeof(out));
+      derive_commit(members[ix].image, members[ix].sz, fname, members[ix].name, &out, 0);
+      if(members[ix].asked) {
+        image = members[ix].image;
+        *sz = members[ix].sz;
+        memcpy(rec, &out, sizeof(out));
+      } else {
+        MagickRelinquishMemory(members[ix].image);
+      }
+    }
+    DestroyMagickWand(members[ix].wand);
+  }
+  return image;
+}
+
+// Responsive images
+//
+// With srcset set to a family of widths, like "320,640,960,1280,1920", a
+// miss for one of them made straight from an original, like
+// photo_r640x480.jpg, makes the whole family at that aspect in one go:
+// the original is decoded once and each width is resized from the next
+// larger one instead of from the original.  The members are encoded in
+// parallel and committed together, so the requests for the other widths
+// that a page sends a moment later are hits.  Widths past the original's
+// aren't made unless they were asked for, and ones already fresh are left
+// alone.
+
+// Whether name, made from an original with one directive, is a member of
+// the family: what it asked for is in *a by *b
+int family_match(const char *name, int *a, int *b) {
+  const char *last = strrchr(name, '_');
+  int ix;
+
+  if(!g_opts.srcset_count || !g_opts.b_disk || !last || last[1] != D_RESIZE || !resize_dims(last + 2, a, b)) {
+    return 0;
+  }
+  for(ix = 0; ix < g_opts.srcset_count && g_opts.srcset[ix] != *a; ix++);
+  return ix < g_opts.srcset_count;
+}
+
+// Makes the family of name, a by b, from the original decoded in wand,
+// which it destroys.  Returns what derive_end would have for name.
+unsigned char *derive_family(MagickWand *wand, const char *fname, const char *name, int a, int b, struct idx_rec *rec, size_t *sz) {
+  struct member *members;
+  struct idx_rec out;
+  MagickWand *from = wand;
+  unsigned char *image;
+  char 
+    directive[32],
+    *ext = strrchr(name, '.');
+
+  int64_t start;
+  int 
+    prefix = strrchr(name, '_') - name,
+    width = (int) MagickGetImageWidth(wand),
+    count = 0,
+    fd,
+    ix,
+    w,
+    h;
+
+  members = (struct member*) calloc(g_opts.srcset_count, sizeof(struct member));
+
+  // widest first, each from the last one made that wasn't scaled up
+  for(ix = 0; ix < g_opts.srcset_count; ix++) {
+    w = g_opts.srcset[ix];
+    h = (int) (((int64_t) w * b + a / 2) / a);
+    if(h < 1) {
+      h = 1;
+    }
+
+    members[count].asked = (w == a);
+    if(members[count].asked) {
+      strcpy(members[count].name, name);
+    } else {
+      if(w > width) {
+        continue;
+      }
+      snprintf(members[count].name, PATH_MAX, "%.*s_r%dx%d%s", prefix, name, w, h, ext);
+      if((fd = cache_lookup(members[count].name, &out, 0)) != -1) {
+        close(fd);
+        continue;
+      }
+    }
+
+    snprintf(directive, sizeof(directive), "%dx%d", w, h);
+    PROBE1(directive__start, directive);
+    start = now_us();
+    members[count].wand = CloneMagickWand(from);
+    image_resize(members[count].wand, directive);
+    stat_time(ST_RESIZE, now_us() - start);
+    if(g_opts.slow_ms) {
+      trace_step(members[count].wand, directive, now_us() - start);
+    }
+    PROBE1(directive__done, directive);
+
+    if(w <= width) {
+      from = members[count].wand;
+    }
+    members[count].format = ext + 1;
+    count++;
+  }
+
+  PROBE1(encode__start, name);
+  members_make(members, count);
+  PROBE2(encode__done, name, (long long) count);
+
+  image = members_commit(members, count, fname, rec, sz);
+  DestroyMagickWand(wand);
+  free(members);
+
+  plog2("Made %d of the family of %s", count, name);
+  return image;
+}
+
+// Tile grids
+//
+// Pages like sample/index.html cut an original into a grid of square
+// tiles, o64x64p0p0, o64x64p0p64 and so on, and ask for all of them.  With
+// grid_tiles set, a miss for a square crop that lines up with its own
+// size, made straight from an original, also makes up to that many of the
+// tiles around it from the same decode, nearest first, so the rest of the
+// grid is mostly hits.  Only so many cells are looked at, however large
+// the grid, and tiles already fresh are left alone.
+
+// Whether name is a tile of a grid: its size and top left are in *size,
+// *y and *x
+int grid_match(const char *name, int *size, int *y, int *x) {
+  const char *last = strrchr(name, '_');
+  int 
+    w,
+    len = 0;
+
+  if(!g_opts.grid_tiles || !g_opts.b_disk || !last || last[1] != D_OFFSET ||
+    sscanf(last + 2, "%dx%dp%dp%d%n", size, &w, y, x, &len) != 4 || last[2 + len] != '.'
+  ) {
+    return 0;
+  }
+  return *size > 0 && *size == w && *y >= 0 && *x >= 0 && !(*y % *size) && !(*x % *size);
+}
+
+// Makes name, the size tile at y, x, and the tiles around it from the
+// original decoded in wand, which it destroys.  Returns what derive_end
+// would have for name.
+unsigned char *derive_grid(MagickWand *wand, const char *fname, const char *name, int size, int y, int x, struct idx_rec *rec, size_t *sz) {
+  struct member *members;
+  struct idx_rec out;
+  unsigned char *image;
+  const char *ext = strrchr(name, '.');
+
+  int 
+    prefix = strrchr(name, '_') - name,
+    rows = ((int) MagickGetImageHeight(wand) + size - 1) / size,
+    cols = ((int) MagickGetImageWidth(wand) + size - 1) / size,
+    row = y / size,
+    col = x / size,
+    looked = 0,
+    count = 1,
+    ring,
+    dy,
+    dx,
+    fd;
+
+  members = (struct member*) calloc(g_opts.grid_tiles + 1, sizeof(struct member));
+  strcpy(members[0].name, name);
+  members[0].asked = 1;
+
+  // a ring at a time, until there are enough or it's looked far enough
+  for(ring = 1; count <= g_opts.grid_tiles && looked < g_opts.grid_tiles * 4 && 
+      (ring <= row || ring <= col || row + ring < rows || col + ring < cols); ring++) {
+    for(dy = -ring; dy <= ring && count <= g_opts.grid_tiles && looked < g_opts.grid_tiles * 4; dy++) {
+      for(dx = -ring; dx <= ring && count <= g_opts.grid_tiles && looked < g_opts.grid_tiles * 4; 
+          dx += (dy == -ring || dy == ring) ? 1 : 2 * ring) {
+        if(row + dy < 0 || row + dy >= rows || col + dx < 0 || col + dx >= cols) {
+          continue;
+        }
+        looked++;
+        snprintf(members[count].name, PATH_MAX, "%.*s_o%dx%dp%dp%d%s", 
+          prefix, name, size, size, (row + dy) * size, (col + dx) * size, ext);
+        if((fd = cache_lookup(members[count].name, &out, 0)) != -1) {
+          close(fd);
+          continue;
+        }
+        count++;
+      }
+    }
+  }
+
+  for(ring = 0; ring < count; ring++) {
+    snprintf(members[ring].crop, sizeof(members[ring].crop), "%s", strrchr(members[ring].name, '_') + 2);
+    *strrchr(members[ring].crop, '.') = 0;
+    members[ring].wand = CloneMagickWand(wand);
+    members[ring].format = ext + 1;
+  }
+
+  PROBE1(encode__start, name);
+  members_make(members, count);
+  PROBE2(encode__done, name, (long long) count);
+
+  image = members_commit(members, count, fname, rec, sz);
+  DestroyMagickWand(wand);
+  free(members);
+
+  plog2("Made %d tiles around %s", count, name);
+  return image;
+}
+
+// Runs the directives in commandList over the image open at fd, named
+// fname, and puts the result in the cache as name.  fd is closed.  rec is
+// what find_base left and comes back as the record of the new derivative.
+// The caller releases what's returned with MagickRelinquishMemory.
+unsigned char *derive(
+    int fd, 
+    const char *fname, 
+    char **commandList, 
+    int count, 
+    const char *name, 
+    struct idx_rec *rec, 
+    size_t *sz
+  ) {
+
+  unsigned char *image;
+  MagickWand *wand;
+  int64_t pixels;
+  int 
+    a, 
+    b,
+    y,
+    x;
+
+  if(!(wand = derive_start(fd, fname, rec))) {
+    return 0;
+  }
+
+  pixels = (int64_t) t_req.width * t_req.height;
+  __sync_fetch_and_add(&g_pixels, pixels);
+  if(count == 1 && !rec->flags && family_match(name, &a, &b)) {
+    image = derive_family(wand, fname, name, a, b, rec, sz);
+  } else if(count == 1 && !rec->flags && grid_match(name, &a, &y, &x)) {
+    image = derive_grid(wand, fname, name, a, y, x, rec, sz);
+  } else {
+    image = derive_end(wand, fname, commandList, count, name, rec, sz);
+  }
+  __sync_fetch_and_sub(&g_pixels, pixels);
+
+  return image;
+}
+
+// Remakes a derivative that went stale, from the current original.  The
+// old one is served until the new one is renamed over it.
+void regenerate(const char *name) {
+  int 
+    count,
+    fd;
+
+  char 
+    fname[PATH_MAX],
+    butcher[PATH_MAX] = {0},
+    *commandList[MAX_DIRECTIVES];
+
+  unsigned char *image;
+  struct idx_rec rec;
+  size_t sz;
+
+  strncpy(butcher, name, PATH_MAX - 1);
+  fd = find_base(butcher, commandList, &count, fname, &rec, 0);
+
+  if(fd == -1) {
+    return;
+  }
+
+  // somebody beat us to it
+  if(!count) {
+    close(fd);
+    return;
+  }
+
+  image = derive(fd, fname, commandList, count, name, &rec, &sz);
+  if(image) {
+    plog1("Regenerated %s", name);
+    MagickRelinquishMemory(image);
+  }
+}
+
+// Prerendering
+//
+// apophnia --prerender manifest makes derivatives ahead of time with the
+// same pipeline as show_image, and no HTTP.  Each line of the manifest is
+// the name of a derivative, as it would be asked for, or a glob of
+// originals under img_root followed by the recipes to make of each:
+//
+//   products/shoe_r320x240.jpg
+//   products/*.jpg r320x240 r640x480 r1280x960_q80 r640x480.png
+//
+// A recipe without an extension keeps the original's.  What's already
+// fresh is skipped.  The rest is grouped by what it's made from, so each
+// original is decoded once for all of its recipes, and the groups are
+// dealt out to a worker per core.  A worker goes through its own share
+// from the front, and when that runs out it steals the back half of
+// whoever has the most left, so a few huge originals don't hold up the
+// end.
+struct pre_target {
+  // name is what goes in the cache; buf is name as find_base cut it up,
+  // which commandList points into
+  char 
+    *name,
+    *fname,
+    *buf,
+    *commandList[MAX_DIRECTIVES];
+
+  int count;
+};
+
+struct pre_job {
+  const char *fname;
+
+  int 
+    first,
+    count;
+};
+
+struct pre_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+
+  // jobs next up to end are this worker's
+  volatile int 
+    next,
+    end;
+};
+
+struct {
+  struct pre_target *target;
+  struct pre_job *job;
+  struct pre_worker *worker;
+
+  int 
+    targets,
+    size,
+    jobs,
+    workers,
+    fresh,
+    missing;
+
+  volatile int 
+    done,
+    made,
+    failed,
+    running;
+
+  volatile int64_t bytes;
+} g_pre;
+
+// Works out what name would be made from and queues it, unless it's
+// already there
+void pre_add(const char *name) {
+  char 
+    butcher[PATH_MAX] = {0},
+    fname[PATH_MAX],
+    *commandList[MAX_DIRECTIVES];
+
+  struct pre_target *target;
+  struct idx_rec rec;
+
+  int 
+    count,
+    fd,
+    ix,
+    len;
+
+  while(*name == '/') { name++; }
+  if(!*name || (len = strlen(name)) >= PATH_MAX) {
+    return;
+  }
+
+  strcpy(butcher, name);
+  fd = find_base(butcher, commandList, &count, fname, &rec, 0);
+  if(fd == -1) {
+    plog0("Nothing to make %s from", name);
+    g_pre.missing++;
+    return;
+  }
+  close(fd);
+
+  if(!count) {
+    g_pre.fresh++;
+    return;
+  }
+
+  if(g_pre.targets == g_pre.size) {
+    g_pre.size = g_pre.size ? g_pre.size * 2 : 1024;
+    g_pre.target = (struct pre_target*) realloc(g_pre.target, g_pre.size * sizeof(struct pre_target));
+  }
+  target = &g_pre.target[g_pre.targets++];
+  target->name = strdup(name);
+  target->fname = strdup(fname);
+  target->buf = (char*) malloc(len + 1);
+  memcpy(target->buf, butcher, len + 1);
+  for(ix = 0; ix < count; ix++) {
+    target->commandList[ix] = target->buf + (commandList[ix] - butcher);
+  }
+  target->count = count;
+}
+
+// "products/*.jpg r320x240 r640x480.png" or a name on its own
+void pre_line(char *line) {
+  char 
+    name[PATH_MAX],
+    *pattern,
+    *recipe,
+    *ext;
+
+  glob_t found;
+  size_t ix;
+  int len;
+
+  if(!(pattern = strtok(line, " \t\r\n")) || pattern[0] == '#') {
+    return;
+  }
+  if(!(recipe = strtok(0, " \t\r\n"))) {
+    pre_add(pattern);
+    return;
+  }
+
+  while(*pattern == '/') { pattern++; }
+  if(glob(pattern, 0, 0, &found)) {
+    plog0("Nothing matches %s", pattern);
+    return;
+  }
+
+  for(; recipe; recipe = strtok(0, " \t\r\n")) {
+    for(ix = 0; ix < found.gl_pathc; ix++) {
+      ext = strrchr(found.gl_pathv[ix], '.');
+      if(!ext || strchr(ext, '/')) {
+        continue;
+      }
+      len = ext - found.gl_pathv[ix];
+      if(snprintf(name, PATH_MAX, "%.*s_%s%s", len, found.gl_pathv[ix], recipe, 
+          strchr(recipe, '.') ? "" : ext) < PATH_MAX) {
+        pre_add(name);
+      }
+    }
+  }
+  globfree(&found);
+}
+
+// By what they're made from, then by name, so a job is a run of targets
+int pre_compare(const void *a, const void *b) {
+  const struct pre_target 
+    *left = (const struct pre_target*) a,
+    *right = (const struct pre_target*) b;
+
+  int diff = strcmp(left->fname, right->fname);
+
+  return diff ? diff : strcmp(left->name, right->name);
+}
+
+// Decodes what the job's targets are made from once and makes each of
+// them from a copy of it
+void pre_job(struct pre_job *job) {
+  struct pre_target *target;
+  struct idx_rec 
+    base,
+    rec;
+
+  MagickWand *wand;
+  unsigned char *image;
+  size_t sz;
+  int 
+    fd,
+    ix;
+
+  // opened the way find_base found it
+  base.flags = 0;
+  if((fd = cache_lookup(job->fname, &base, 0)) == -1) {
+    base.flags = 0;
+    fd = base_open(job->fname);
+  }
+  if(fd == -1 || !(wand = derive_start(fd, job->fname, &base))) {
+    plog0("Couldn't read %s", job->fname);
+    __sync_fetch_and_add(&g_pre.failed, job->count);
+    return;
+  }
+
+  for(ix = 0; ix < job->count; ix++) {
+    target = &g_pre.target[job->first + ix];
+    memcpy(&rec, &base, sizeof(rec));
+
+    image = derive_end(ix < job->count - 1 ? CloneMagickWand(wand) : wand, 
+      job->fname, target->commandList, target->count, target->name, &rec, &sz);
+
+    if(image) {
+      __sync_fetch_and_add(&g_pre.made, 1);
+      __sync_fetch_and_add(&g_pre.bytes, (int64_t) sz);
+      MagickRelinquishMemory(image);
+    } else {
+      plog0("Couldn't make %s", target->name);
+      __sync_fetch_and_add(&g_pre.failed, 1);
+    }
+  }
+}
+
+// The next job for worker self, its own or stolen, or -1 when there are
+// none left anywhere
+int pre_take(int self) {
+  struct pre_worker 
+    *me = &g_pre.worker[self],
+    *victim;
 
-  ptr = butcher;
-  do {
-    fd = open(ptr, O_RDONLY);
-    
-    // If the source image changes, then we have to change the converted images
-    // But because we don't want a bunch of inotifies and we want to make this
-    // rather kernel-neutral, we just do an occational stat on the base file
-    // to see if it has a different mtime or ctime.
-    //
-    // Even though this isn't atomically incremented, it doesn't matter.   
-    // The point is that we wish to do *occasional* checks just so we aren't
-    // way out of sync.
-    g_stat_check++;
-
-    if(fd > 0) {
+  int 
+    job = -1,
+    end,
+    left,
+    most,
+    ix;
+
+  pthread_mutex_lock(&me->lock);
+  if(me->next < me->end) {
+    job = me->next++;
+  }
+  pthread_mutex_unlock(&me->lock);
+
+  while(job == -1) {
+    victim = 0;
+    most = 0;
+    for(ix = 0; ix < g_pre.workers; ix++) {
+      left = g_pre.worker[ix].end - g_pre.worker[ix].next;
+      if(ix != self && left > most) {
+        most = left;
+        victim = &g_pre.worker[ix];
+      }
+    }
+    if(!victim) {
       break;
     }
 
-    // we start the string parsing routines.
-    last = ptr + strlen(ptr);
-
-    // this passes over the string ^^ once and then VV twice
+    // one lock at a time, so two thieves can't deadlock on each other
+    pthread_mutex_lock(&victim->lock);
+    left = victim->end - victim->next;
+    end = victim->end;
+    if(left > 0) {
+      victim->end -= (left + 1) / 2;
+      job = victim->end;
+    }
+    pthread_mutex_unlock(&victim->lock);
 
-    // get the extension
-    for(; (last > ptr) && (*last != '.'); last--);
-    
-    if(last[0] == '.') {
-      last[0] = 0;
-      ext = last + 1;
-    } else {
-      break;
+    if(job != -1) {
+      pthread_mutex_lock(&me->lock);
+      me->next = job + 1;
+      me->end = end;
+      pthread_mutex_unlock(&me->lock);
     }
+  }
+  return job;
+}
 
-    for(;;) {
-      // find the first clause to try to dump
-      for(; (last > ptr) && (*last != '_'); last--);
+void *pre_thread(void *arg) {
+  int 
+    self = (int) (intptr_t) arg,
+    job;
 
-      if(last[0] == '_') {
-        last[0] = 0;
+  while((job = pre_take(self)) != -1) {
+    pre_job(&g_pre.job[job]);
+    __sync_fetch_and_add(&g_pre.done, 1);
+  }
+  __sync_fetch_and_sub(&g_pre.running, 1);
+  return 0;
+}
 
-        // add this as a command
-        *pCommand = (last - ptr) + 1 + butcher;
-        pCommand++;
-        fname[last - ptr] = '.';
+void pre_progress(const char *what, int64_t start) {
+  int seconds = (int) ((now_us() - start) / 1000000);
 
-        strcpy(fname + (last - ptr + 1), ext);
-        //plog3("Trying %s", fname);
-        fd = open(fname, O_RDONLY);
+  plog0("%s %d of %d originals, %d made, %d failed in %ds, %d/s, %dMB", 
+    what, g_pre.done, g_pre.jobs, g_pre.made, g_pre.failed, seconds,
+    seconds ? g_pre.made / seconds : g_pre.made, (int) (g_pre.bytes >> 20));
+}
 
-        if(fd > 0) {
-          break;
-        }
+int prerender(FILE *manifest) {
+  char line[PATH_MAX * 2];
+  int64_t start = now_us();
+  int 
+    kept = 0,
+    ix,
+    share;
 
-        // FALLBACKS
-        // Find the index in the check if any.
-        for(formatIndex = 0; formatCheck[formatIndex].extension; formatIndex++) {
-          if (!strcmp(ext, formatCheck[formatIndex].extension)) {
-            break;
-          }
-        }
+  if(!g_opts.b_disk) {
+    plog0("Nothing is kept with disk set to 0; not prerendering");
+    return 1;
+  }
 
-        if (!formatCheck[formatIndex].extension) {
-          break;
-        }
+  while(fgets(line, sizeof(line), manifest)) {
+    pre_line(line);
+  }
 
-        for(
-          formatOffset = 0;
-          formatCheck[formatIndex].fallbacks[formatOffset];
-          formatOffset++
-        ) {
-          ext = formatCheck[formatIndex].fallbacks[formatOffset];
-          strcpy(fname + (last - ptr + 1), ext);
-          //plog3("Trying %s", fname);
-          fd = open(fname, O_RDONLY);
-
-          if(fd > 0) {
-            break;
-          }
-        }
-      } else {
-        // we must give up eventually
-        break;
-      }
-    } 
-  } while(0);
+  // runs of the same original, without the same name twice
+  qsort(g_pre.target, g_pre.targets, sizeof(struct pre_target), pre_compare);
+  g_pre.job = (struct pre_job*) calloc(g_pre.targets + 1, sizeof(struct pre_job));
+  for(ix = 0; ix < g_pre.targets; ix++) {
+    if(ix && !strcmp(g_pre.target[ix].name, g_pre.target[ix - 1].name)) {
+      continue;
+    }
+    if(!g_pre.jobs || strcmp(g_pre.job[g_pre.jobs - 1].fname, g_pre.target[ix].fname)) {
+      g_pre.job[g_pre.jobs].fname = g_pre.target[ix].fname;
+      g_pre.job[g_pre.jobs++].first = kept;
+    }
+    // with the duplicates gone the rest move down
+    g_pre.target[kept++] = g_pre.target[ix];
+    g_pre.job[g_pre.jobs - 1].count++;
+  }
+  g_pre.targets = kept;
 
-  // we have a file handle
-  if(fd > 0) {
-    if(fstat(fd, &st)) {
-      return do404(conn);
+  plog0("Prerendering %d derivatives of %d originals, %d already fresh, %d with nothing to make them from",
+    g_pre.targets, g_pre.jobs, g_pre.fresh, g_pre.missing);
+
+  // the workers are the parallelism, so Magick shouldn't add its own
+  g_pre.workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if(g_pre.workers > g_pre.jobs) {
+    g_pre.workers = g_pre.jobs;
+  }
+  if(g_pre.workers < 1) {
+    g_pre.workers = 1;
+  }
+  MagickSetResourceLimit(ThreadResource, 1);
+
+  g_pre.worker = (struct pre_worker*) calloc(g_pre.workers, sizeof(struct pre_worker));
+  share = (g_pre.jobs + g_pre.workers - 1) / g_pre.workers;
+  for(ix = 0; ix < g_pre.workers; ix++) {
+    pthread_mutex_init(&g_pre.worker[ix].lock, 0);
+    g_pre.worker[ix].next = ix * share < g_pre.jobs ? ix * share : g_pre.jobs;
+    g_pre.worker[ix].end = (ix + 1) * share < g_pre.jobs ? (ix + 1) * share : g_pre.jobs;
+  }
+
+  g_pre.running = g_pre.workers;
+  for(ix = 0; ix < g_pre.workers; ix++) {
+    pthread_create(&g_pre.worker[ix].thread, 0, pre_thread, (void*) (intptr_t) ix);
+  }
+
+  for(ix = 1; g_pre.running; ix++) {
+    usleep(100000);
+    if(ix % 50 == 0) {
+      pre_progress("Prerendered", start);
     }
+  }
+  for(ix = 0; ix < g_pre.workers; ix++) {
+    pthread_join(g_pre.worker[ix].thread, 0);
+  }
 
-    mg_printf(conn, "%s", "HTTP/1.1 200 OK\r\n");
-    mg_printf(conn, "%s", "Content-Type: image/jpeg\r\n");
-    //mg_printf(conn, "%s", "Connection: Keep-Alive\r\n");
-
-    // add cache control headers
-    now = time( (time_t*) 0 );
-     (void) strftime( nowbuf, sizeof(nowbuf), rfc1123fmt, gmtime( &now ) );
-    mg_printf(conn, "Date: %s\r\n", nowbuf);
-    if (g_opts.max_age > 0) {
-      expires = now + g_opts.max_age;
-      mod = st.st_mtime;
-      (void) strftime( expbuf, sizeof(expbuf), rfc1123fmt, gmtime( &expires ) );
-      (void) strftime( modbuf, sizeof(modbuf), rfc1123fmt, gmtime( &mod ) );
-      mg_printf(conn, "Cache-Control: max-age=%d\r\n", g_opts.max_age );
-      mg_printf(conn, "Last-Modified: %s\r\n", modbuf);
-      mg_printf(conn, "Expires: %s\r\n", expbuf);
-    }
-
-    // if this is the case then we have a command string to parse
-    if(pCommand != commandList) {
-      
-      // get the full requested name
-      strcpy(fname, ptr);
-
-      // now null out the extension pointer from above
-      // we won't need it any more
-      //ext[0] = 0;
-      image_start(wand, fd);
-      for(pTmp = pCommand - 1; (pTmp + 1) != commandList; pTmp--) {
-        // plog3("Command: [%s]", *pTmp);
-
-        switch(*pTmp[0]) {
-          case D_RESIZE:
-            image_resize(wand, *pTmp + 1);
-            break;
+  if(g_opts.pack_max) {
+    pack_checkpoint();
+  }
+  pre_progress("Done:", start);
+  log_drain();
 
-          case D_OFFSET:
-            image_offset(wand, *pTmp + 1);
-            break;
+  return g_pre.failed != 0;
+}
 
-          case D_QUALITY:
-            image_quality(wand, *pTmp + 1);
-            break;
+// Under load, a miss for a resize can be answered with a cached resize of
+// the same thing that's within degrade_tolerance percent of the size that
+// was asked for; the browser scales it.  The candidates are the other
+// derivatives of the original find_base got to, fname or rec's source.
+// Returns the closest one's fd, preferring larger on ties, with rec as its
+// record, or -1.
+int degrade(const char *name, const char *fname, struct idx_rec *rec) {
+  char 
+    key[PATH_MAX],
+    src[IDX_KEYLEN],
+    best[IDX_KEYLEN] = {0},
+    *ext,
+    *last,
+    *cand;
 
-          default:
-            plog2("Unknown directive: %s", *pTmp);
-            break;
-        }  
+  int 
+    a, b,
+    ca, cb,
+    ix,
+    len,
+    score,
+    bestScore = -1;
 
-      }
-      image = image_end(wand, &sz);
+  struct dep *node;
+
+  if(!g_opts.degrade || !g_idx) {
+    return -1;
+  }
+
+  recipe_key(name, key);
+  ext = strrchr(key, '.');
+  last = strrchr(key, '_');
+  if(!ext || !last || last > ext || last[1] != D_RESIZE || !resize_dims(last + 2, &a, &b)) {
+    return -1;
+  }
+  // everything up to and including the 'r'
+  len = last + 2 - key;
 
-      // Only save the file unless disk is set to false.
-      if (g_opts.b_disk) {
-        MagickWriteImage(wand, request_info->uri + 1);
+  strncpy(src, rec->flags ? rec->src : fname, IDX_KEYLEN - 1);
+  src[IDX_KEYLEN - 1] = 0;
+
+  pthread_mutex_lock(&g_dep_lock);
+  for(node = g_deps[hash_str(src) % DEP_BUCKETS]; node; node = node->next) {
+    if(strcmp(node->src, src)) {
+      continue;
+    }
+    for(ix = 0; ix < node->count; ix++) {
+      cand = node->keys[ix];
+      if(strncmp(cand, key, len) || !strrchr(cand, '.') || 
+        strcmp(strrchr(cand, '.'), ext) || !resize_dims(cand + len, &ca, &cb)
+      ) {
+        continue;
+      }
+      if(abs(ca - a) * 100 > a * g_opts.degrade || abs(cb - b) * 100 > b * g_opts.degrade) {
+        continue;
       }
+      score = (abs(ca - a) + abs(cb - b)) * 2 + (ca < a || cb < b);
+      if(bestScore == -1 || score < bestScore) {
+        bestScore = score;
+        strcpy(best, cand);
+      }
+    }
+    break;
+  }
+  pthread_mutex_unlock(&g_dep_lock);
 
-      MagickRelinquishMemory(image);
-      fd = open(request_info->uri + 1, O_RDONLY);
-      plog2("%s", request_info->uri + 1);
-      fstat(fd, &st);
+  if(!best[0]) {
+    return -1;
+  }
+  return cache_lookup(best, rec, 0);
+}
+
+void *serve_image(
+    struct mg_connection *conn
+  ) {
+
+  int 
+    count = 0,
+    fd = -1,
+    alt; 
+
+  const char* rfc1123fmt = "%a, %d %b %Y %H:%M:%S GMT";
+  const struct mg_request_info *request_info = mg_get_request_info(conn);
+
+  char 
+    fname[PATH_MAX] = {0},
+    butcher[PATH_MAX] = {0},
+
+    *commandList[MAX_DIRECTIVES] = {0}, 
+
+    *etag,
+    *outcome = "HIT",
+  
+    tagbuf[24] = {0},
+    nowbuf[100] = {0},
+    modbuf[100] = {0},
+    expbuf[100] = {0};
+
+  unsigned char *image = 0;
+
+  struct stat st;
+
+  struct idx_rec rec;
+
+  size_t sz;
+
+  int64_t start;
+
+  time_t 
+    now, 
+    mod, 
+    expires;
+
+  strncpy(butcher, request_info->uri + 1, PATH_MAX - 1);
+
+  start = now_us();
+  fd = find_base(butcher, commandList, &count, fname, &rec, 1);
+  stat_time(ST_LOOKUP, now_us() - start);
+
+  if(fd != -1 && !count) {
+    PROBE1(lookup__hit, request_info->uri);
+  } else {
+    PROBE2(lookup__miss, request_info->uri, count);
+  }
+
+  if(fd == -1) {
+    return do404(conn);
+  }
+
+  if(g_opts.pregen_top) {
+    recipe_seen(request_info->uri + 1, rec.flags ? rec.src : fname);
+  }
+
+  now = time( (time_t*) 0 );
+
+  // Too busy to make it: something close enough, or nothing
+  if(count && load_shed()) {
+    alt = degrade(request_info->uri + 1, fname, &rec);
+    close(fd);
+
+    if(alt == -1) {
+      __sync_fetch_and_add(&g_load.shed, 1);
+      return do503(conn);
     }
-    mg_printf(conn, "Content-Length: %d\r\n\r\n", (int) st.st_size);
 
-    for(;;) {  
-      ret = read(fd, buf, BUFSIZE);
+    __sync_fetch_and_add(&g_load.degraded, 1);
+    if(!bg_submit(regenerate, request_info->uri + 1, BG_LATER)) {
+      stat_count(C_COALESCED, 1);
+    }
+    outcome = "DEGRADED";
+    fd = alt;
+    count = 0;
+  }
 
-      if(!ret) {
-        break;
-      }
+  // if this is the case then we have a command string to parse
+  if(count) {
+    start = now_us();
+    __sync_fetch_and_add(&g_load.inflight, 1);
+    image = derive(fd, fname, commandList, count, request_info->uri + 1, &rec, &sz);
+    __sync_fetch_and_sub(&g_load.inflight, 1);
+    load_sample(now_us() - start);
+    fd = -1;
 
-      ret = mg_write(conn, buf, ret);
+    if(!image) {
+      return do404(conn);
+    }
+
+    outcome = "MISS";
+    st.st_size = sz;
+    mod = now;
+
+  // a derivative from the index needs nothing more
+  } else if(rec.flags) {
+    st.st_size = rec.size;
+    mod = rec.created;
+
+    // Serve what we have while it's remade in the background
+    if(rec.stale) {
+      outcome = "STALE";
+      if(!bg_submit(regenerate, request_info->uri + 1, BG_NOW)) {
+        stat_count(C_COALESCED, 1);
+      }
     }
-    close(fd);
-    
   } else {
-    return do404(conn);
+    if(fstat(fd, &st)) {
+      close(fd);
+      return do404(conn);
+    }
+    mod = st.st_mtime;
   }
 
-  DestroyMagickWand(wand);
+  // Only derivatives from the index have a tag, and a stand-in has none
+  etag = 0;
+  if(g_idx && rec.flags && outcome[0] != 'D') {
+    sprintf(tagbuf, "\"%016llx\"", (unsigned long long) rec.etag);
+    etag = tagbuf;
+
+    if(mg_get_header(conn, "If-None-Match") && 
+      !strcmp(mg_get_header(conn, "If-None-Match"), etag)
+    ) {
+      if(fd != -1) {
+        close(fd);
+      }
+      if(image) {
+        MagickRelinquishMemory(image);
+      }
+      stat_count(outcome[0] == 'S' ? C_STALE : C_HIT, 1);
+      t_req.status = 304;
+      t_req.outcome = outcome;
+      mg_printf(conn, "%s", "HTTP/1.1 304 Not Modified\r\n");
+      mg_printf(conn, "ETag: %s\r\n\r\n", etag);
+      return (void*)1;
+    }
+  }
+
+  mg_printf(conn, "%s", "HTTP/1.1 200 OK\r\n");
+  mg_printf(conn, "%s", "Content-Type: image/jpeg\r\n");
+  mg_printf(conn, "X-Cache: %s\r\n", outcome);
+  t_req.status = 200;
+  t_req.outcome = outcome;
+  switch(outcome[0]) {
+    case 'H': stat_count(C_HIT, 1); break;
+    case 'M': stat_count(C_MISS, 1); break;
+    case 'S': stat_count(C_STALE, 1); break;
+  }
+  //mg_printf(conn, "%s", "Connection: Keep-Alive\r\n");
+
+  // add cache control headers
+  (void) strftime( nowbuf, sizeof(nowbuf), rfc1123fmt, gmtime( &now ) );
+  mg_printf(conn, "Date: %s\r\n", nowbuf);
+  if (outcome[0] == 'S') {
+    // a stale copy shouldn't outlive its replacement anywhere downstream
+    mg_printf(conn, "Cache-Control: max-age=0, stale-while-revalidate=%d\r\n", g_opts.swr);
+  } else if (outcome[0] == 'D') {
+    // nor should a stand-in
+    mg_printf(conn, "Cache-Control: max-age=%d\r\n", g_opts.degrade_max_age);
+  } else if (g_opts.max_age > 0) {
+    expires = now + g_opts.max_age;
+    (void) strftime( expbuf, sizeof(expbuf), rfc1123fmt, gmtime( &expires ) );
+    (void) strftime( modbuf, sizeof(modbuf), rfc1123fmt, gmtime( &mod ) );
+    if (g_opts.swr > 0) {
+      mg_printf(conn, "Cache-Control: max-age=%d, stale-while-revalidate=%d\r\n", g_opts.max_age, g_opts.swr );
+    } else {
+      mg_printf(conn, "Cache-Control: max-age=%d\r\n", g_opts.max_age );
+    }
+    mg_printf(conn, "Last-Modified: %s\r\n", modbuf);
+    mg_printf(conn, "Expires: %s\r\n", expbuf);
+  }
+  if(etag) {
+    mg_printf(conn, "ETag: %s\r\n", etag);
+  }
+  mg_printf(conn, "Content-Length: %d\r\n\r\n", (int) st.st_size);
+
+  start = now_us();
+  if(image) {
+    t_req.bytes = mg_write(conn, image, sz);
+    MagickRelinquishMemory(image);
+  } else {
+    t_req.bytes = mg_send_fd(conn, fd, rec.flags && rec.pack ? rec.offset : 0, st.st_size);
+    close(fd);
+  }
+  stat_count(C_BYTES, t_req.bytes);
+  stat_time(ST_SEND, now_us() - start);
 
   return (void*)1;
 }
 
+void *show_image(
+    struct mg_connection *conn
+  ) {
+
+  const char *uri = mg_get_request_info(conn)->uri;
+  int64_t start = now_us();
+  void *ret;
+
+  if(!strcmp(uri, STATS_URL)) {
+    return show_stats(conn);
+  }
+
+  memset(&t_req, 0, sizeof(t_req));
+  PROBE1(request__start, uri);
+  ret = serve_image(conn);
+  stat_time(ST_REQUEST, now_us() - start);
+  PROBE3(request__done, uri, t_req.status, (long long) t_req.bytes);
+
+  if(g_opts.access_log && log_keep()) {
+    log_access(uri);
+  }
+  if(g_opts.slow_ms) {
+    t_req.queued = mg_get_queue_wait(conn) / 1000;
+    if(t_req.queued + t_req.stage[ST_REQUEST] >= (int64_t) g_opts.slow_ms * 1000) {
+      log_slow(uri, t_req.queued + t_req.stage[ST_REQUEST]);
+    }
+  }
+  return ret;
+}
+
+// "320,640,960" into srcset, widest first
+void srcset_parse(const char *list) {
+  int 
+    width,
+    ix;
+
+  g_opts.srcset_count = 0;
+  while(*list && g_opts.srcset_count < SRCSET_MAX) {
+    width = atoi(list);
+    if(width > 0) {
+      for(ix = g_opts.srcset_count++; ix > 0 && g_opts.srcset[ix - 1] < width; ix--) {
+        g_opts.srcset[ix] = g_opts.srcset[ix - 1];
+      }
+      g_opts.srcset[ix] = width;
+    }
+    list += strcspn(list, ",");
+    list += (*list == ',');
+  }
+  plog3(" Srcset: %d widths", g_opts.srcset_count);
+}
+
 int read_config(){
   char 
     *start = 0,
@@ -723,6 +5041,8 @@ int read_config(){
   struct stat st;
 
   memset((void*)&g_opts, 0, sizeof(g_opts));
+  g_opts.log_fd = 1;
+  g_opts.slow_fd = -1;
         
   fd = open(CONFIG, O_RDONLY);
   if(fd == -1) {
@@ -747,7 +5067,15 @@ int read_config(){
   g_opts.log_level = 0;
   g_opts.b_disk = 1;
 
+  g_opts.index_slots = 65536;
+  g_opts.bg_threads = 2;
+  g_opts.pack_size = 64 << 20;
+  g_opts.retry_after = 1;
+  g_opts.degrade_max_age = 10;
+  g_opts.slow_rate = 10;
+
   strcpy(g_opts.img_root, "./");
+  strcpy(g_opts.index_file, "apophnia.idx");
 
   plog3 = plog2 = plog1 = log_fake;
   for(ix = 0; args[ix].arg; ix ++) {
@@ -764,11 +5092,18 @@ int read_config(){
                 }
               }
             } else if(!strcmp(args[ix].arg, "log_file")) {
-              g_opts.log_fd = open(element->valuestring, O_WRONLY);
-              if(!g_opts.log_fd) {
-                g_opts.log_fd = open("/dev/stdout", O_WRONLY);
+              g_opts.log_fd = open(element->valuestring, O_WRONLY | O_CREAT | O_APPEND, 0644);
+              if(g_opts.log_fd == -1) {
+                g_opts.log_fd = 1;
                 plog0("Couldn't open log file");
               }
+            } else if(!strcmp(args[ix].arg, "srcset")) {
+              srcset_parse(element->valuestring);
+            } else if(!strcmp(args[ix].arg, "slow_log")) {
+              g_opts.slow_fd = open(element->valuestring, O_WRONLY | O_CREAT | O_APPEND, 0644);
+              if(g_opts.slow_fd == -1) {
+                plog0("Couldn't open slow log file");
+              }
             } else {
               strncpy((char*)args[ix].param, element->valuestring, PATH_MAX);
               plog3(" %s: %s\n", args[ix].string, element->valuestring);
@@ -786,14 +5121,29 @@ int read_config(){
 
   // set up the logs
   switch(g_opts.log_level) {
-    case 3: plog3 = log_real;
-    case 2: plog2 = log_real;
+    case 3: plog3 = log_sampled;
+    case 2: plog2 = log_sampled;
     case 1: plog1 = log_real;
   }
 
   munmap(start, st.st_size);
   close(fd);
 
+  // A relative cache_root is relative to where we started, not img_root
+  if(g_opts.cache_root[0]) {
+    mkdir(g_opts.cache_root, 0755);
+    g_cache_fd = open(g_opts.cache_root, O_RDONLY | O_DIRECTORY);
+    if(g_cache_fd == -1) {
+      fatal("Couldn't open the cache root %s", g_opts.cache_root);
+    }
+    plog3("Caching derivatives in %s", g_opts.cache_root);
+  }
+
+  g_idx_slots = g_opts.index_slots > 0 ? g_opts.index_slots : 0;
+  pack_open();
+  idx_open();
+  pack_recover();
+
   if(chdir(g_opts.img_root)) {
     fatal("Couldn't change directories to %s",g_opts.img_root);
   }
@@ -801,48 +5151,222 @@ int read_config(){
   return 1;
 }
 
+#ifdef __linux__ // {
+#define WATCH_MASK  (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// The directory of every watch, by its descriptor, relative to img_root
+char **g_watch = 0;
+int g_watch_size = 0;
+
+// Watches dir and everything under it, except for the cache if it's in there.
+void watch_tree(const char *dir) {
+  DIR *pDir;
+  struct dirent *entry;
+  struct stat 
+    st,
+    cache;
+
+  char path[PATH_MAX];
+  int wd;
+
+  wd = inotify_add_watch(g_notify_handle, dir, WATCH_MASK);
+  if(wd < 0) {
+    plog0("Couldn't watch %s", dir);
+    return;
+  }
+
+  if(wd >= g_watch_size) {
+    g_watch = (char**) realloc(g_watch, (wd + 64) * sizeof(char*));
+    memset(g_watch + g_watch_size, 0, (wd + 64 - g_watch_size) * sizeof(char*));
+    g_watch_size = wd + 64;
+  }
+  free(g_watch[wd]);
+  g_watch[wd] = strdup(dir);
+
+  if(!(pDir = opendir(dir))) {
+    return;
+  }
+
+  if(g_cache_fd != AT_FDCWD) {
+    fstat(g_cache_fd, &cache);
+  }
+
+  while((entry = readdir(pDir))) {
+    if(entry->d_name[0] == '.' && (!entry->d_name[1] || 
+      (entry->d_name[1] == '.' && !entry->d_name[2]))
+    ) {
+      continue;
+    }
+
+    if(strcmp(dir, ".")) {
+      snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name);
+    } else {
+      snprintf(path, PATH_MAX, "%s", entry->d_name);
+    }
+
+    if(lstat(path, &st) || !S_ISDIR(st.st_mode)) {
+      continue;
+    }
+
+    if(g_cache_fd != AT_FDCWD && st.st_dev == cache.st_dev && st.st_ino == cache.st_ino) {
+      continue;
+    }
+
+    watch_tree(path);
+  }
+  closedir(pDir);
+}
+
+// An original showed up: the pregen_top most asked for recipes of it are
+// queued to be made in the background, see recipe_seen.  Derivatives
+// written next to their originals, and files on their way there, aren't
+// originals.
+void pregen(const char *path) {
+  char 
+    names[PREGEN_MAX][RECIPE_LEN],
+    name[PATH_MAX];
+
+  const char 
+    *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path,
+    *ext = strrchr(base, '.'),
+    *last = strrchr(base, '_');
+
+  int64_t counts[PREGEN_MAX];
+  int 
+    found,
+    ix;
+
+  if(!ext || base[0] == '.' || !strcmp(ext, ".tmp")) {
+    return;
+  }
+  for(ix = 0; last && directives[ix].pfix; ix++) {
+    if(last[1] == '.' || (last[1] == directives[ix].pfix && last[2] >= '0' && last[2] <= '9')) {
+      return;
+    }
+  }
+
+  found = recipe_top(names, counts, g_opts.pregen_top < PREGEN_MAX ? g_opts.pregen_top : PREGEN_MAX);
+  for(ix = 0; ix < found; ix++) {
+    if(snprintf(name, PATH_MAX, "%.*s%s%s", (int) (ext - path), path, names[ix], 
+        strchr(names[ix], '.') ? "" : ext) < PATH_MAX && 
+      bg_submit(regenerate, name, BG_LATER)
+    ) {
+      stat_count(C_PREGEN, 1);
+    }
+  }
+  plog1("New original %s, pregenerating %d recipes", path, found);
+}
+
+void watch_event(struct inotify_event *event) {
+  char path[PATH_MAX];
+
+  if(event->mask & IN_Q_OVERFLOW) {
+    plog0("Lost inotify events, rescanning");
+    watch_tree(".");
+    rescan();
+    return;
+  }
+
+  if(event->wd < 0 || event->wd >= g_watch_size || !g_watch[event->wd]) {
+    return;
+  }
+
+  if(event->mask & IN_IGNORED) {
+    free(g_watch[event->wd]);
+    g_watch[event->wd] = 0;
+    return;
+  }
+
+  // the watched directory itself went away
+  if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    invalidate(g_watch[event->wd], 1);
+    return;
+  }
+
+  if(!event->len) {
+    return;
+  }
+
+  if(strcmp(g_watch[event->wd], ".")) {
+    snprintf(path, PATH_MAX, "%s/%s", g_watch[event->wd], event->name);
+  } else {
+    snprintf(path, PATH_MAX, "%s", event->name);
+  }
+
+  plog3("Changed: %s", path);
+
+  if(event->mask & IN_ISDIR) {
+    if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+      watch_tree(path);
+    } 
+    if(event->mask & IN_MOVED_FROM) {
+      invalidate(path, 1);
+    }
+    return;
+  }
+
+  // Anything that happens to an original, including being replaced by
+  // something moved over it, invalidates its derivatives.
+  invalidate(path, 0);
+
+  // once it's all there
+  if(g_opts.pregen_top && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) {
+    pregen(path);
+  }
+}
+#endif // }
+
 void main_loop(){
 #if !defined __linux__
   #error KQUEUE needs to be written.  Exiting.
 #else
   fd_set rfds;
+  struct timeval tv;
+  time_t last = 0;
 
   int 
     ret,
-    i = 0,
+    i,
     len;
 
-  char buf[BUF_LEN];
+  char buf[BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
 
-  g_notify = inotify_add_watch (g_notify_handle,
-    g_opts.img_root,
-    IN_MODIFY | IN_CREATE | IN_DELETE
-  );
+  // img_root is the working directory
+  watch_tree(".");
 
-  MagickWandGenesis();
+  // whatever changed while we weren't running
+  if(g_idx) {
+    rescan();
+  }
 
   for(;;) {
     setjmp(g_jump_buf);
 
+    // housekeeping
+    if(time(0) - last >= 10) {
+      last = time(0);
+      pack_maintain();
+      recipe_decay();
+    }
+
     FD_ZERO (&rfds);
     FD_SET (g_notify_handle, &rfds);
-    ret = select (g_notify_handle + 1, &rfds, NULL, NULL, NULL);
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    ret = select (g_notify_handle + 1, &rfds, NULL, NULL, &tv);
 
-    if (FD_ISSET (g_notify_handle, &rfds)) {
+    if (ret > 0 && FD_ISSET (g_notify_handle, &rfds)) {
 
       len = read(g_notify_handle, buf, BUF_LEN);
 
-      while (i < len) {
+      for (i = 0; i < len;) {
         struct inotify_event *event;
 
         event = (struct inotify_event *) &buf[i];
 
-        plog3("wd=%d mask=%u cookie=%u len=%u",
-          event->wd, event->mask,
-          event->cookie, event->len);
-
-        if (event->len) {
-          plog3("name=%s", event->name);
+        if(g_idx) {
+          watch_event(event);
         }
 
         i += EVENT_SIZE + event->len;
@@ -870,19 +5394,40 @@ const struct mg_callbacks mongoose_cb = {
     0   // upload
 };
 
-int main() {
+// Without NO_MAIN; bench/pipeline.c links the rest of this in
+#ifndef NO_MAIN // {
+int main(int argc, char **argv) {
   struct mg_context *ctx;
-
-  signal(SIGPIPE, sighandle);
+  FILE *manifest = 0;
 
   plog0 = log_real;
+
+  // the manifest is relative to where we started, not img_root
+  if(argc == 3 && !strcmp(argv[1], "--prerender")) {
+    manifest = strcmp(argv[2], "-") ? fopen(argv[2], "r") : stdin;
+    if(!manifest) {
+      fatal("Couldn't open %s", argv[2]);
+    }
+  } else if(argc != 1) {
+    fprintf(stderr, "usage: %s [--prerender manifest]\n", argv[0]);
+    return 1;
+  }
+
   plog0("Starting Apophnia...");
  
   if(!read_config()) {
     plog0("Unable to read the config");
   }
+  log_start();
 
+  MagickWandGenesis();
+  if(manifest) {
+    return prerender(manifest);
+  }
+
+  signal(SIGPIPE, sighandle);
   g_notify_handle = NOTIFY_INIT;
+  bg_start();
 
   {
     const char *options[] = {
@@ -893,7 +5438,7 @@ int main() {
 
     plog3("Listening on port %d", g_opts.port);
 
-    ctx = mg_start(
+    g_ctx = ctx = mg_start(
       &mongoose_cb,
       NULL, 
       options
@@ -908,3 +5453,4 @@ int main() {
   main_loop();
   return 0;
 }
+#endif // }
@@ -0,0 +1,426 @@
+// Makes a corpus of synthetic originals to benchmark against
+//
+// sample/create-sample.sh makes one 1024x768 PNG; this makes as many
+// originals as asked for, across baseline and progressive JPEG, PNG with
+// and without alpha and with a palette, still and animated GIF, BMP and
+// TIFF, at sizes drawn from a log-uniform range with an optional share of
+// huge ones, fanned out over nested directories:
+//
+//   make bench
+//   bench/corpus -o /srv/corpus -n 100000 -d 2 -w 32 -j 8
+//
+// makes /srv/corpus/1f/03/000123.jpg and so on.  Every image is a
+// resampled and recoloured cut of one noisy texture, which is much faster
+// than drawing each one and still gives the encoders real work.  What
+// each image is depends only on the seed and its number, so the same
+// arguments make the same corpus however many threads make it.  A JSON
+// summary goes to stdout.
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <wand/MagickWand.h>
+
+#define TEXTURE       512
+#define NOISE         0.1
+#define MAX_PATH      1024
+
+// the kinds of original, and the share of the corpus each gets by default
+#define K_JPEG        0
+#define K_PJPEG       1
+#define K_PNG         2
+#define K_PNGA        3
+#define K_PNG8        4
+#define K_GIF         5
+#define K_AGIF        6
+#define K_BMP         7
+#define K_TIFF        8
+#define K_COUNT       9
+
+struct {
+  const char
+    *name,
+    *format,
+    *ext;
+
+  int weight;
+} g_kinds[] = {
+  { "jpeg", "JPEG", "jpg", 40 },
+  { "pjpeg", "JPEG", "jpg", 10 },
+  { "png", "PNG24", "png", 15 },
+  { "pnga", "PNG32", "png", 10 },
+  { "png8", "PNG8", "png", 5 },
+  { "gif", "GIF", "gif", 6 },
+  { "agif", "GIF", "gif", 4 },
+  { "bmp", "BMP", "bmp", 5 },
+  { "tiff", "TIFF", "tif", 5 }
+};
+
+struct {
+  char *root;
+
+  int
+    count,
+    depth,
+    fanout,
+    threads,
+    seed,
+    min,
+    max,
+    huge,
+    huge_width,
+    huge_height,
+    frames;
+} g_opts = {
+  0, 1000, 2, 16, 1, 1, 64, 2048, 0, 8000, 6000, 6
+};
+
+MagickWand *g_texture;
+
+volatile int g_next = 0;
+
+struct {
+  int64_t
+    made[K_COUNT],
+    bytes[K_COUNT],
+    failed;
+} g_done;
+
+pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// splitmix64: a good stream of numbers from any starting point, so each
+// image gets its own from the seed and its number
+uint64_t rnd(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+double rnd_unit(uint64_t *state) {
+  return (rnd(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// number/fanout^depth ... number%fanout, one directory each, then the file
+void image_path(int number, const char *ext, char *path, int mkdirs) {
+  int
+    len = snprintf(path, MAX_PATH, "%s", g_opts.root),
+    level,
+    div = 1;
+
+  for(level = 1; level < g_opts.depth; level++) {
+    div *= g_opts.fanout;
+  }
+  for(level = 0; level < g_opts.depth; level++, div /= g_opts.fanout) {
+    len += snprintf(path + len, MAX_PATH - len, "/%02x", (number / div) % g_opts.fanout);
+    if(mkdirs) {
+      mkdir(path, 0755);
+    }
+  }
+  snprintf(path + len, MAX_PATH - len, "/%06d.%s", number, ext);
+}
+
+// Log-uniform from min to max, so there are as many per octave of small
+// images as of big ones
+int pick_side(uint64_t *state) {
+  return (int) (g_opts.min * pow((double) g_opts.max / g_opts.min, rnd_unit(state)));
+}
+
+int pick_kind(uint64_t *state) {
+  int
+    total = 0,
+    pick,
+    ix;
+
+  for(ix = 0; ix < K_COUNT; ix++) {
+    total += g_kinds[ix].weight;
+  }
+  pick = rnd(state) % total;
+  for(ix = 0; pick >= g_kinds[ix].weight; ix++) {
+    pick -= g_kinds[ix].weight;
+  }
+  return ix;
+}
+
+// The texture everything is cut from: a gradient with Gaussian noise of
+// NOISE deviation over it.  The noise comes from rnd(), as ImageMagick's
+// own generator isn't seeded by anything we set.
+int make_texture() {
+  uint64_t state = ((uint64_t) g_opts.seed << 32) ^ 0xffffffffULL;
+  float *pixels = (float*) malloc(sizeof(float) * 3 * TEXTURE * TEXTURE);
+  double 
+    u,
+    v,
+    r;
+
+  int
+    ix,
+    ok;
+
+  g_texture = NewMagickWand();
+  MagickSetSize(g_texture, TEXTURE, TEXTURE);
+  if(!pixels || MagickReadImage(g_texture, "gradient:navy-orange") == MagickFalse ||
+    MagickExportImagePixels(g_texture, 0, 0, TEXTURE, TEXTURE, "RGB", FloatPixel, pixels) == MagickFalse
+  ) {
+    free(pixels);
+    return 0;
+  }
+
+  // Box-Muller, two deviates at a time
+  for(ix = 0; ix < 3 * TEXTURE * TEXTURE; ix += 2) {
+    u = 1 - rnd_unit(&state);
+    v = rnd_unit(&state) * 6.283185307179586;
+    r = sqrt(-2 * log(u)) * NOISE;
+    pixels[ix] += r * cos(v);
+    pixels[ix + 1] += r * sin(v);
+  }
+  for(ix = 0; ix < 3 * TEXTURE * TEXTURE; ix++) {
+    pixels[ix] = pixels[ix] < 0 ? 0 : pixels[ix] > 1 ? 1 : pixels[ix];
+  }
+
+  ok = MagickImportImagePixels(g_texture, 0, 0, TEXTURE, TEXTURE, "RGB", FloatPixel, pixels) != MagickFalse;
+  free(pixels);
+  return ok;
+}
+
+// A cut of the texture at width x height, in its own colours
+MagickWand *make_frame(uint64_t *state, int width, int height) {
+  MagickWand *wand = CloneMagickWand(g_texture);
+  int
+    cut = TEXTURE / 4 + rnd(state) % (TEXTURE * 3 / 4),
+    x = rnd(state) % (TEXTURE - cut + 1),
+    y = rnd(state) % (TEXTURE - cut + 1);
+
+  MagickCropImage(wand, cut, cut, x, y);
+  MagickSetImagePage(wand, 0, 0, 0, 0);
+  MagickSampleImage(wand, width, height);
+  MagickModulateImage(wand, 70 + rnd(state) % 60, 50 + rnd(state) % 100, rnd(state) % 200);
+  return wand;
+}
+
+// A ramp from clear to opaque across the image at some angle, with NOISE
+// from rnd() over it, so PNG32 originals carry an alpha channel that
+// isn't all one value.  Done a row at a time to keep huge ones small.
+int make_alpha(MagickWand *wand, uint64_t *state, int width, int height) {
+  float *row = (float*) malloc(sizeof(float) * 4 * width);
+  double 
+    angle = rnd_unit(state) * 6.283185307179586,
+    dx = cos(angle) / width,
+    dy = sin(angle) / height,
+    span = fabs(cos(angle)) + fabs(sin(angle)),
+    // puts the corner the ramp starts from at 0
+    base = (dx < 0 ? -cos(angle) : 0) + (dy < 0 ? -sin(angle) : 0),
+    a;
+
+  int
+    x,
+    y,
+    ok = row && MagickSetImageAlphaChannel(wand, SetAlphaChannel) != MagickFalse;
+
+  for(y = 0; ok && y < height; y++) {
+    ok = MagickExportImagePixels(wand, 0, y, width, 1, "RGBA", FloatPixel, row) != MagickFalse;
+    for(x = 0; ok && x < width; x++) {
+      a = (x * dx + y * dy + base) / span + (rnd_unit(state) - 0.5) * 2 * NOISE;
+      row[x * 4 + 3] = a < 0 ? 0 : a > 1 ? 1 : a;
+    }
+    ok = ok && MagickImportImagePixels(wand, 0, y, width, 1, "RGBA", FloatPixel, row) != MagickFalse;
+  }
+  free(row);
+  return ok;
+}
+
+int make_image(int number) {
+  char path[MAX_PATH];
+  MagickWand
+    *wand,
+    *frame;
+  struct stat st;
+  uint64_t state = ((uint64_t) g_opts.seed << 32) ^ number;
+
+  int
+    kind = pick_kind(&state),
+    width,
+    height,
+    ix,
+    ok;
+
+  if(g_opts.huge && (int) (rnd(&state) % 100) < g_opts.huge) {
+    width = g_opts.huge_width;
+    height = g_opts.huge_height;
+  } else {
+    width = pick_side(&state);
+    height = pick_side(&state);
+  }
+
+  wand = make_frame(&state, width, height);
+  if(kind == K_AGIF) {
+    for(ix = 1; ix < g_opts.frames; ix++) {
+      frame = make_frame(&state, width, height);
+      MagickAddImage(wand, frame);
+      DestroyMagickWand(frame);
+    }
+    MagickResetIterator(wand);
+    while(MagickNextImage(wand) != MagickFalse) {
+      MagickSetImageDelay(wand, 10);
+    }
+  }
+  if(kind == K_PJPEG) {
+    MagickSetImageInterlaceScheme(wand, PlaneInterlace);
+  }
+  MagickSetImageCompressionQuality(wand, 75 + rnd(&state) % 20);
+  MagickSetImageFormat(wand, g_kinds[kind].format);
+
+  image_path(number, g_kinds[kind].ext, path, 1);
+  ok = (kind != K_PNGA || make_alpha(wand, &state, width, height)) &&
+    MagickWriteImages(wand, path, MagickTrue) != MagickFalse && !stat(path, &st);
+  DestroyMagickWand(wand);
+
+  pthread_mutex_lock(&g_lock);
+  if(ok) {
+    g_done.made[kind]++;
+    g_done.bytes[kind] += st.st_size;
+  } else {
+    g_done.failed++;
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  return ok;
+}
+
+void *worker(void *arg) {
+  int number;
+
+  while((number = __sync_fetch_and_add(&g_next, 1)) < g_opts.count) {
+    if(!make_image(number)) {
+      fprintf(stderr, "Couldn't make image %d\n", number);
+    }
+  }
+  return arg;
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+    "usage: %s -o dir [-n count] [-d depth] [-w fanout] [-j threads] [-s seed]\n"
+    "          [-m min] [-M max] [-H percent] [-X WxH] [-f kind:weight,...]\n"
+    "\n"
+    "  -o  where the corpus goes\n"
+    "  -n  how many originals (1000)\n"
+    "  -d  levels of directories (2)\n"
+    "  -w  directories in each level (16)\n"
+    "  -j  threads making images (1)\n"
+    "  -s  seed (1)\n"
+    "  -m  smallest side, in pixels (64)\n"
+    "  -M  largest side, drawn log-uniform between the two (2048)\n"
+    "  -H  percent of originals that are huge (0)\n"
+    "  -X  the size of the huge ones (8000x6000)\n"
+    "  -f  how much of each kind, out of jpeg:40, pjpeg:10, png:15, pnga:10,\n"
+    "      png8:5, gif:6, agif:4, bmp:5 and tiff:5; kinds not named keep\n"
+    "      their weight, so jpeg:0,agif:20 drops baseline JPEG for animations\n",
+    self);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  pthread_t *threads;
+  char *tok;
+  time_t start = time(0);
+
+  int64_t
+    made = 0,
+    bytes = 0;
+
+  int
+    opt,
+    weight,
+    ix;
+
+  while((opt = getopt(argc, argv, "o:n:d:w:j:s:m:M:H:X:f:")) != -1) {
+    switch(opt) {
+      case 'o': g_opts.root = optarg; break;
+      case 'n': g_opts.count = atoi(optarg); break;
+      case 'd': g_opts.depth = atoi(optarg); break;
+      case 'w': g_opts.fanout = atoi(optarg); break;
+      case 'j': g_opts.threads = atoi(optarg); break;
+      case 's': g_opts.seed = atoi(optarg); break;
+      case 'm': g_opts.min = atoi(optarg); break;
+      case 'M': g_opts.max = atoi(optarg); break;
+      case 'H': g_opts.huge = atoi(optarg); break;
+      case 'X':
+        if(sscanf(optarg, "%dx%d", &g_opts.huge_width, &g_opts.huge_height) != 2) {
+          usage(argv[0]);
+        }
+        break;
+      case 'f':
+        for(tok = strtok(optarg, ","); tok; tok = strtok(0, ",")) {
+          for(ix = 0; ix < K_COUNT; ix++) {
+            if(!strncmp(tok, g_kinds[ix].name, strlen(g_kinds[ix].name)) &&
+                tok[strlen(g_kinds[ix].name)] == ':') {
+              break;
+            }
+          }
+          if(ix == K_COUNT || (weight = atoi(strchr(tok, ':') + 1)) < 0) {
+            usage(argv[0]);
+          }
+          g_kinds[ix].weight = weight;
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  for(weight = ix = 0; ix < K_COUNT; ix++) {
+    weight += g_kinds[ix].weight;
+  }
+  if(!g_opts.root || g_opts.count < 1 || g_opts.depth < 0 || g_opts.fanout < 1 ||
+      g_opts.threads < 1 || g_opts.min < 1 || g_opts.max < g_opts.min || !weight) {
+    usage(argv[0]);
+  }
+  if(mkdir(g_opts.root, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Couldn't make %s\n", g_opts.root);
+    return 1;
+  }
+
+  MagickWandGenesis();
+  if(!make_texture()) {
+    fprintf(stderr, "Couldn't make the texture\n");
+    return 1;
+  }
+
+  threads = calloc(g_opts.threads, sizeof(pthread_t));
+  for(ix = 0; ix < g_opts.threads; ix++) {
+    pthread_create(&threads[ix], 0, worker, 0);
+  }
+  for(ix = 0; ix < g_opts.threads; ix++) {
+    pthread_join(threads[ix], 0);
+  }
+
+  printf("{\n");
+  printf("  \"root\": \"%s\",\n", g_opts.root);
+  printf("  \"seed\": %d,\n", g_opts.seed);
+  printf("  \"kinds\": {\n");
+  for(ix = 0; ix < K_COUNT; ix++) {
+    printf("    \"%s\": { \"count\": %lld, \"bytes\": %lld }%s\n", g_kinds[ix].name,
+      (long long) g_done.made[ix], (long long) g_done.bytes[ix], ix < K_COUNT - 1 ? "," : "");
+    made += g_done.made[ix];
+    bytes += g_done.bytes[ix];
+  }
+  printf("  },\n");
+  printf("  \"count\": %lld,\n", (long long) made);
+  printf("  \"bytes\": %lld,\n", (long long) bytes);
+  printf("  \"failed\": %lld,\n", (long long) g_done.failed);
+  printf("  \"seconds\": %lld\n", (long long) (time(0) - start));
+  printf("}\n");
+
+  DestroyMagickWand(g_texture);
+  MagickWandTerminus();
+  return g_done.failed != 0;
+}
@@ -0,0 +1,180 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include "http.h"
+
+#define REQUEST_BUF   2048
+#define RESPONSE_BUF  65536
+
+// a read that waits longer than this is an error, not a sample
+#define READ_TIMEOUT  10
+
+struct sockaddr_in g_http_addr;
+char g_http_host[256];
+
+int64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compare_int64(const void *a, const void *b) {
+  int64_t diff = *(const int64_t*) a - *(const int64_t*) b;
+  return diff < 0 ? -1 : diff > 0;
+}
+
+int http_resolve(const char *host, int port) {
+  struct hostent *entry = gethostbyname(host);
+
+  if(!entry) {
+    return 0;
+  }
+  g_http_addr.sin_family = AF_INET;
+  g_http_addr.sin_port = htons(port);
+  memcpy(&g_http_addr.sin_addr, entry->h_addr, sizeof(g_http_addr.sin_addr));
+  snprintf(g_http_host, sizeof(g_http_host), "%s", host);
+  return 1;
+}
+
+void http_init(struct http_client *client, int keep_alive) {
+  client->fd = -1;
+  client->keep_alive = keep_alive;
+}
+
+int http_connect() {
+  struct timeval timeout = { READ_TIMEOUT, 0 };
+  int
+    fd = socket(AF_INET, SOCK_STREAM, 0),
+    on = 1;
+
+  if(fd == -1) {
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if(connect(fd, (struct sockaddr*) &g_http_addr, sizeof(g_http_addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Where the headers in buf end, or 0 if they haven't yet.  Lines can end
+// in a bare LF, as mongoose's own error pages do.
+char *http_headers_end(char *buf) {
+  char *nl;
+
+  for(nl = strchr(buf, '\n'); nl; nl = strchr(nl + 1, '\n')) {
+    if(nl[1] == '\n') {
+      return nl + 2;
+    }
+    if(nl[1] == '\r' && nl[2] == '\n') {
+      return nl + 3;
+    }
+  }
+  return 0;
+}
+
+// One request on fd.  *reuse says whether the connection can take another.
+int http_once(int fd, int keep_alive, const char *url, struct http_response *out, int *reuse) {
+  char
+    buf[RESPONSE_BUF],
+    request[REQUEST_BUF],
+    *end,
+    *header;
+
+  int
+    len,
+    got = 0;
+
+  int64_t length = -1;
+
+  len = snprintf(request, sizeof(request),
+    "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+    url, g_http_host, keep_alive ? "keep-alive" : "close");
+  if(len >= REQUEST_BUF || write(fd, request, len) != len) {
+    return -1;
+  }
+
+  // the headers
+  for(;;) {
+    if(got == RESPONSE_BUF - 1) {
+      return -1;
+    }
+    if((len = read(fd, buf + got, RESPONSE_BUF - 1 - got)) <= 0) {
+      return -1;
+    }
+    got += len;
+    buf[got] = 0;
+    if((end = http_headers_end(buf))) {
+      break;
+    }
+  }
+  if(sscanf(buf, "HTTP/1.%*d %d", &out->status) != 1) {
+    return -1;
+  }
+
+  *reuse = keep_alive;
+  out->cache[0] = 0;
+  for(header = strchr(buf, '\n'); header && header < end; header = strchr(header + 1, '\n')) {
+    if(!strncasecmp(header + 1, "Content-Length:", 15)) {
+      length = strtoll(header + 16, 0, 10);
+    } else if(!strncasecmp(header + 1, "Connection: close", 17)) {
+      *reuse = 0;
+    } else if(!strncasecmp(header + 1, "X-Cache: ", 9)) {
+      sscanf(header + 10, "%15[^\r\n]", out->cache);
+    }
+  }
+
+  // the body, up to Content-Length or until the server closes
+  out->bytes = got - (end - buf);
+  while(length == -1 || out->bytes < length) {
+    if((len = read(fd, buf, RESPONSE_BUF)) <= 0) {
+      if(length == -1 && !len) {
+        *reuse = 0;
+        break;
+      }
+      return -1;
+    }
+    out->bytes += len;
+  }
+  return 0;
+}
+
+int http_get(struct http_client *client, const char *url, struct http_response *out) {
+  int
+    ret = -1,
+    reuse,
+    timed_out,
+    tries;
+
+  for(tries = 0; tries < 2; tries++) {
+    if(client->fd == -1 && (client->fd = http_connect()) == -1) {
+      return -1;
+    }
+    reuse = 0;
+    ret = http_once(client->fd, client->keep_alive, url, out, &reuse);
+    timed_out = ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    if(!reuse || ret == -1) {
+      close(client->fd);
+      client->fd = -1;
+    }
+
+    // a server that went quiet isn't given another wait
+    if(ret != -1 || timed_out) {
+      break;
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,38 @@
+// A small blocking HTTP/1.1 client that the benchmark tools share
+#ifndef BENCH_HTTP_H
+#define BENCH_HTTP_H
+
+#include <stdint.h>
+
+struct http_client {
+  int
+    fd,
+    keep_alive;
+};
+
+struct http_response {
+  int status;
+  int64_t bytes;
+
+  // X-Cache, or empty
+  char cache[16];
+};
+
+// Where every client connects; 0 if host can't be resolved
+int http_resolve(const char *host, int port);
+
+void http_init(struct http_client *client, int keep_alive);
+
+// GETs url and reads the whole response into out.  A kept-alive
+// connection that the server closed gets one more try on a new one.
+// Returns 0, or -1 if there was no response, or none in time.
+int http_get(struct http_client *client, const char *url, struct http_response *out);
+
+int64_t now_ns();
+
+// Index of the q quantile in count sorted values
+#define QUANTILE(count, q) ((int64_t) ((q) * ((count) - 1)))
+
+int compare_int64(const void *a, const void *b);
+
+#endif
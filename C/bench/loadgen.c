@@ -0,0 +1,337 @@
+// A load generator for apophnia
+//
+// Replays the tile grid that sample/index.html draws (o-crops of
+// example.png at 16, 32, 64, 128 and 256), a spread of resizes, or both,
+// from a fixed number of connections, and prints throughput and latency
+// percentiles as JSON.  The first pass over the URLs is the cold phase,
+// which only makes derivatives if the server starts with an empty
+// cache_root; the passes after it are the warm phase.
+//
+//   make bench
+//   bench/loadgen -p 1210 -c 32 -w mixed > before.json
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include "http.h"
+
+#define MAX_URL       128
+
+#define W_GRID        0
+#define W_RESIZE      1
+#define W_MIXED       2
+
+const char *g_workloads[] = { "grid", "resize", "mixed", 0 };
+
+struct {
+  char
+    *host,
+    *image,
+    *ext;
+
+  int
+    port,
+    concurrency,
+    keep_alive,
+    workload,
+    passes,
+    seed,
+    width,
+    height;
+} g_opts = {
+  "127.0.0.1", "example", "jpg", 1210, 16, 1, W_MIXED, 3, 1, 1024, 768
+};
+
+char (*g_urls)[MAX_URL] = 0;
+int g_url_count = 0;
+
+// What a phase hands out, one URL at a time, to all the clients
+struct phase {
+  const char *name;
+
+  int
+    total,
+    passes;
+
+  volatile int next;
+
+  int64_t
+    start,
+    end;
+};
+
+struct client {
+  pthread_t thread;
+  struct phase *phase;
+  struct http_client http;
+
+  int
+    count,
+    size;
+
+  int64_t
+    *latency,
+    bytes,
+    errors;
+};
+
+// Adds /image_<directives>.ext, with the directives printf'd from fmt
+void url_add(const char *fmt, ...) {
+  static int size = 0;
+  va_list ap;
+  int len;
+
+  if(g_url_count == size) {
+    size = size ? size * 2 : 1024;
+    g_urls = realloc(g_urls, size * MAX_URL);
+  }
+  len = snprintf(g_urls[g_url_count], MAX_URL / 2, "/%s_", g_opts.image);
+  va_start(ap, fmt);
+  len += vsnprintf(g_urls[g_url_count] + len, MAX_URL / 4, fmt, ap);
+  va_end(ap);
+  snprintf(g_urls[g_url_count] + len, MAX_URL / 4, ".%s", g_opts.ext);
+  g_url_count++;
+}
+
+// Every tile of every grid, as sample/index.html asks for them
+void make_grid() {
+  int
+    size,
+    x,
+    y;
+
+  for(size = 16; size <= 256; size *= 2) {
+    for(y = 0; y < g_opts.height; y += size) {
+      for(x = 0; x < g_opts.width; x += size) {
+        url_add("o%dx%dp%dp%d", size, size, y, x);
+      }
+    }
+  }
+}
+
+// Thumbnails to near full size, some at a lower quality, some cropped
+// after resizing.  Widths keep the original's aspect.
+void make_resize() {
+  int
+    width,
+    height;
+
+  for(width = 32; width <= g_opts.width; width += 32) {
+    height = width * g_opts.height / g_opts.width;
+    url_add("r%dx%d", width, height);
+    url_add("r%dx%d_q%d", width, height, 40 + width % 60);
+    if(width >= 64) {
+      url_add("r%dx%d_o%dx%dp%dp%d", width, height, height / 2, width / 2, height / 4, width / 4);
+    }
+  }
+}
+
+// Fisher-Yates with our own generator, so a seed gives the same order
+// everywhere
+void shuffle() {
+  char tmp[MAX_URL];
+  uint32_t state = g_opts.seed;
+  int
+    ix,
+    pick;
+
+  for(ix = g_url_count - 1; ix > 0; ix--) {
+    state = state * 1664525 + 1013904223;
+    pick = (state >> 8) % (ix + 1);
+    memcpy(tmp, g_urls[ix], MAX_URL);
+    memcpy(g_urls[ix], g_urls[pick], MAX_URL);
+    memcpy(g_urls[pick], tmp, MAX_URL);
+  }
+}
+
+void *client_run(void *arg) {
+  struct client *client = (struct client*) arg;
+  struct phase *phase = client->phase;
+  struct http_response response;
+  int64_t start;
+  int ix;
+
+  while((ix = __sync_fetch_and_add(&phase->next, 1)) < phase->total) {
+    start = now_ns();
+    if(http_get(&client->http, g_urls[ix % g_url_count], &response) || response.status != 200) {
+      client->errors++;
+      continue;
+    }
+    if(client->count == client->size) {
+      client->size = client->size ? client->size * 2 : 4096;
+      client->latency = realloc(client->latency, client->size * sizeof(int64_t));
+    }
+    client->latency[client->count++] = now_ns() - start;
+    client->bytes += response.bytes;
+  }
+  return 0;
+}
+
+// Runs the phase over every client and prints what it did
+void run_phase(struct phase *phase, struct client *clients, int last) {
+  const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  const char *names[] = { "p50_ms", "p90_ms", "p99_ms", "p999_ms" };
+
+  int64_t
+    *all,
+    bytes = 0,
+    errors = 0;
+
+  int
+    count = 0,
+    ix;
+
+  double seconds;
+
+  phase->next = 0;
+  for(ix = 0; ix < g_opts.concurrency; ix++) {
+    clients[ix].phase = phase;
+    clients[ix].count = 0;
+    clients[ix].bytes = 0;
+    clients[ix].errors = 0;
+  }
+
+  phase->start = now_ns();
+  for(ix = 0; ix < g_opts.concurrency; ix++) {
+    pthread_create(&clients[ix].thread, 0, client_run, &clients[ix]);
+  }
+  for(ix = 0; ix < g_opts.concurrency; ix++) {
+    pthread_join(clients[ix].thread, 0);
+    count += clients[ix].count;
+  }
+  phase->end = now_ns();
+
+  all = malloc((count + 1) * sizeof(int64_t));
+  for(count = ix = 0; ix < g_opts.concurrency; ix++) {
+    memcpy(all + count, clients[ix].latency, clients[ix].count * sizeof(int64_t));
+    count += clients[ix].count;
+    bytes += clients[ix].bytes;
+    errors += clients[ix].errors;
+  }
+  qsort(all, count, sizeof(int64_t), compare_int64);
+  seconds = (phase->end - phase->start) / 1e9;
+
+  printf("    \"%s\": {\n", phase->name);
+  printf("      \"passes\": %d,\n", phase->passes);
+  printf("      \"requests\": %d,\n", count);
+  printf("      \"errors\": %lld,\n", (long long) errors);
+  printf("      \"bytes\": %lld,\n", (long long) bytes);
+  printf("      \"seconds\": %.3f,\n", seconds);
+  printf("      \"requests_per_second\": %.1f,\n", seconds > 0 ? count / seconds : 0);
+  for(ix = 0; ix < 4; ix++) {
+    printf("      \"%s\": %.3f,\n", names[ix],
+      count ? all[QUANTILE(count, quantiles[ix])] / 1e6 : 0);
+  }
+  printf("      \"max_ms\": %.3f\n", count ? all[count - 1] / 1e6 : 0);
+  printf("    }%s\n", last ? "" : ",");
+  free(all);
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+    "usage: %s [-h host] [-p port] [-c connections] [-K] [-w grid|resize|mixed]\n"
+    "          [-n warm passes] [-s seed] [-i image] [-e extension] [-g widthxheight]\n"
+    "\n"
+    "  -h  server address (127.0.0.1)\n"
+    "  -p  server port (1210)\n"
+    "  -c  concurrent connections (16)\n"
+    "  -K  a new connection for every request instead of keep-alive\n"
+    "  -w  which URLs to ask for (mixed)\n"
+    "  -n  passes over the URLs after the cold one (3)\n"
+    "  -s  seed for the order of the URLs (1)\n"
+    "  -i  the original, without its extension (example)\n"
+    "  -e  the extension asked for (jpg)\n"
+    "  -g  the original's size, which the grid covers (1024x768)\n",
+    self);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  struct client *clients;
+  struct phase
+    cold,
+    warm;
+  int
+    opt,
+    ix;
+
+  while((opt = getopt(argc, argv, "h:p:c:Kw:n:s:i:e:g:")) != -1) {
+    switch(opt) {
+      case 'h': g_opts.host = optarg; break;
+      case 'p': g_opts.port = atoi(optarg); break;
+      case 'c': g_opts.concurrency = atoi(optarg); break;
+      case 'K': g_opts.keep_alive = 0; break;
+      case 'n': g_opts.passes = atoi(optarg); break;
+      case 's': g_opts.seed = atoi(optarg); break;
+      case 'i': g_opts.image = optarg; break;
+      case 'e': g_opts.ext = optarg; break;
+      case 'g':
+        if(sscanf(optarg, "%dx%d", &g_opts.width, &g_opts.height) != 2) {
+          usage(argv[0]);
+        }
+        break;
+      case 'w':
+        for(ix = 0; g_workloads[ix] && strcmp(g_workloads[ix], optarg); ix++);
+        if(!g_workloads[ix]) {
+          usage(argv[0]);
+        }
+        g_opts.workload = ix;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if(g_opts.concurrency < 1 || g_opts.passes < 0) {
+    usage(argv[0]);
+  }
+
+  if(!http_resolve(g_opts.host, g_opts.port)) {
+    fprintf(stderr, "Can't resolve %s\n", g_opts.host);
+    return 1;
+  }
+
+  if(g_opts.workload != W_RESIZE) {
+    make_grid();
+  }
+  if(g_opts.workload != W_GRID) {
+    make_resize();
+  }
+  shuffle();
+
+  clients = calloc(g_opts.concurrency, sizeof(struct client));
+  for(ix = 0; ix < g_opts.concurrency; ix++) {
+    http_init(&clients[ix].http, g_opts.keep_alive);
+  }
+
+  memset(&cold, 0, sizeof(cold));
+  memset(&warm, 0, sizeof(warm));
+  cold.name = "cold";
+  cold.passes = 1;
+  warm.name = "warm";
+  cold.total = g_url_count;
+  warm.passes = g_opts.passes;
+  warm.total = g_url_count * g_opts.passes;
+
+  printf("{\n");
+  printf("  \"host\": \"%s\",\n", g_opts.host);
+  printf("  \"port\": %d,\n", g_opts.port);
+  printf("  \"workload\": \"%s\",\n", g_workloads[g_opts.workload]);
+  printf("  \"connections\": %d,\n", g_opts.concurrency);
+  printf("  \"keep_alive\": %d,\n", g_opts.keep_alive);
+  printf("  \"seed\": %d,\n", g_opts.seed);
+  printf("  \"urls\": %d,\n", g_url_count);
+  printf("  \"phases\": {\n");
+  run_phase(&cold, clients, !g_opts.passes);
+  if(g_opts.passes) {
+    run_phase(&warm, clients, 1);
+  }
+  printf("  }\n");
+  printf("}\n");
+
+  return 0;
+}
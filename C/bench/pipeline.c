@@ -0,0 +1,612 @@
+// Micro-benchmarks of the transform pipeline, without HTTP
+//
+// Links against apophnia.c built with NO_MAIN and times its own stages on
+// synthetic originals: image_start decoding each format, image_resize at
+// several scales, image_offset crops, and image_quality with image_end
+// encoding each format.  MagickResizeImage is also timed directly with a
+// few filters, as the baseline that image_resize is measured against, and
+// a tile of a resize is timed both ways: resizing everything and cropping,
+// and image_region making just the tile.
+//
+// The tile is also checked against resizing everything, and recipes are
+// made both as plan_make plans them and as they're asked for.  Those are
+// "region_check" and "check" lines, with the largest difference in any
+// channel, 0 to 1, and the PSNR; if any is past its tolerance, or the two
+// aren't the same size on the same canvas, the run exits 1.
+//
+// Every result is one JSON object per line:
+//
+//   {"op":"decode","format":"JPEG","width":1024,"height":768,"iterations":5,
+//    "ns_per_op":..., "min_ns":..., "ns_per_pixel":..., "mb_per_s":...,
+//    "peak_rss_kb":...}
+//
+// ns_per_pixel is over the pixels of the original.  mb_per_s is over the
+// encoded bytes for decode and encode, and over the original's pixels at
+// 4 bytes each for the rest.  peak_rss_kb is the process's high-water
+// mark so far.
+//
+//   make bench
+//   bench/pipeline -n 10 -s 640x480,4000x3000 -f JPEG,PNG > pipeline.json
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <wand/MagickWand.h>
+
+#define MAX_SIZES     16
+#define MAX_FORMATS   16
+#define MAX_CHAIN     8
+#define PLAN_LEN      48
+
+// from apophnia.c
+extern void (*plog0)(const char*t, ...);
+extern void (*plog1)(const char*t, ...);
+extern void (*plog2)(const char*t, ...);
+extern void (*plog3)(const char*t, ...);
+void log_fake(const char*t, ...);
+
+int image_start(MagickWand *wand, int fd, uint64_t offset, size_t size);
+unsigned char* image_end(MagickWand *wand, const char *format, size_t *sz);
+int image_offset(MagickWand *wand, char*ptr);
+int image_quality(MagickWand *wand, char*ptr);
+int image_resize(MagickWand *wand, char*ptr);
+int image_region(MagickWand *wand, char*ptr);
+int image_directive(MagickWand *wand, char *directive);
+int gcd(int a, int b);
+int plan_make(MagickWand *wand, char **commandList, int count, const char *format, char (*plan)[PLAN_LEN], int *left);
+
+struct {
+  int
+    iterations,
+    sizes,
+    formats,
+    width[MAX_SIZES],
+    height[MAX_SIZES],
+    failed;
+
+  char *format[MAX_FORMATS];
+} g_bench = { .iterations = 5 };
+
+struct {
+  const char *name;
+  FilterTypes filter;
+} g_filters[] = {
+  { "point", PointFilter },
+  { "triangle", TriangleFilter },
+  { "catrom", CatromFilter },
+  { "lanczos", LanczosFilter },
+  { 0 }
+};
+
+const double g_scales[] = { 0.125, 0.25, 0.5, 2.0, 0 };
+
+int64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// What one op took over all its iterations, as a line of output
+struct timing {
+  int64_t
+    sum,
+    min,
+    bytes;
+
+  int count;
+};
+
+void timing_add(struct timing *t, int64_t ns) {
+  if(!t->count || ns < t->min) {
+    t->min = ns;
+  }
+  t->sum += ns;
+  t->count++;
+}
+
+void report(const char *op, const char *what, const char *value, int width, int height, struct timing *t) {
+  struct rusage usage;
+  double mean = t->count ? (double) t->sum / t->count : 0;
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("{\"op\":\"%s\",", op);
+  if(what) {
+    printf("\"%s\":\"%s\",", what, value);
+  }
+  printf("\"width\":%d,\"height\":%d,\"iterations\":%d,", width, height, t->count);
+  printf("\"ns_per_op\":%.0f,\"min_ns\":%lld,", mean, (long long) t->min);
+  printf("\"ns_per_pixel\":%.3f,", mean / ((double) width * height));
+  printf("\"mb_per_s\":%.2f,", mean ? (t->bytes ? t->bytes : (double) width * height * 4) / mean * 1e3 : 0);
+  printf("\"peak_rss_kb\":%ld}\n", usage.ru_maxrss);
+  fflush(stdout);
+}
+
+// Something with detail everywhere so encoders have work to do: a
+// gradient, with noise over it
+MagickWand *make_source(int width, int height) {
+  MagickWand *wand = NewMagickWand();
+
+  MagickSetSize(wand, width, height);
+  if(MagickReadImage(wand, "gradient:navy-orange") == MagickFalse) {
+    fprintf(stderr, "Couldn't make a %dx%d image\n", width, height);
+    exit(1);
+  }
+  MagickAddNoiseImage(wand, GaussianNoise);
+  return wand;
+}
+
+// The source in format, in a file that's left open so every decode can
+// read it from the start.  The file itself is gone already.
+int make_file(MagickWand *source, const char *format, size_t *size) {
+  char path[] = "/tmp/pipelineXXXXXX";
+  MagickWand *wand = CloneMagickWand(source);
+  unsigned char *blob;
+  int fd;
+
+  MagickSetImageFormat(wand, format);
+  blob = MagickGetImageBlob(wand, size);
+  DestroyMagickWand(wand);
+
+  if(!blob || (fd = mkstemp(path)) == -1) {
+    fprintf(stderr, "Couldn't encode %s\n", format);
+    exit(1);
+  }
+  unlink(path);
+  if(write(fd, blob, *size) != (ssize_t) *size) {
+    fprintf(stderr, "Couldn't write %s\n", format);
+    exit(1);
+  }
+  MagickRelinquishMemory(blob);
+  return fd;
+}
+
+// How far apart a and b are: the largest difference in any channel, 0 to
+// 1, with the PSNR over all of them in *psnr.  Returns -1 if they aren't
+// the same size on the same canvas.
+double image_diff(MagickWand *a, MagickWand *b, double *psnr) {
+  size_t 
+    width = MagickGetImageWidth(a),
+    height = MagickGetImageHeight(a),
+    page_width[2],
+    page_height[2],
+    ix;
+
+  ssize_t 
+    page_x[2],
+    page_y[2];
+
+  float 
+    *pa,
+    *pb;
+
+  double 
+    max = 0,
+    sum = 0,
+    d;
+
+  MagickGetImagePage(a, &page_width[0], &page_height[0], &page_x[0], &page_y[0]);
+  MagickGetImagePage(b, &page_width[1], &page_height[1], &page_x[1], &page_y[1]);
+  if(width != MagickGetImageWidth(b) || height != MagickGetImageHeight(b) ||
+    page_width[0] != page_width[1] || page_height[0] != page_height[1] || 
+    page_x[0] != page_x[1] || page_y[0] != page_y[1]
+  ) {
+    return -1;
+  }
+
+  pa = (float*) malloc(sizeof(float) * 4 * width * height);
+  pb = (float*) malloc(sizeof(float) * 4 * width * height);
+  if(!pa || !pb ||
+    MagickExportImagePixels(a, 0, 0, width, height, "RGBA", FloatPixel, pa) == MagickFalse ||
+    MagickExportImagePixels(b, 0, 0, width, height, "RGBA", FloatPixel, pb) == MagickFalse
+  ) {
+    fprintf(stderr, "Couldn't read a %dx%d image\n", (int) width, (int) height);
+    exit(1);
+  }
+  for(ix = 0; ix < 4 * width * height; ix++) {
+    d = pa[ix] > pb[ix] ? pa[ix] - pb[ix] : pb[ix] - pa[ix];
+    max = d > max ? d : max;
+    sum += d * d;
+  }
+  free(pa);
+  free(pb);
+
+  sum /= 4.0 * width * height;
+  *psnr = sum ? -10 * log10(sum) : 999;
+  return max;
+}
+
+void report_check(const char *op, const char *what, const char *value, int width, int height, double diff, double psnr, double tolerance) {
+  int ok = diff >= 0 && diff <= tolerance;
+
+  printf("{\"op\":\"%s\",\"%s\":\"%s\",", op, what, value);
+  printf("\"width\":%d,\"height\":%d,", width, height);
+  printf("\"max_diff\":%.6f,\"psnr\":%.2f,\"ok\":%s}\n", diff, diff >= 0 ? psnr : 0, ok ? "true" : "false");
+  fflush(stdout);
+  if(!ok) {
+    g_bench.failed = 1;
+  }
+}
+
+// image_start closes what it's given, so it gets its own descriptor
+MagickWand *bench_decode(int file, size_t size, const char *format, int width, int height) {
+  struct timing t = { 0 };
+  MagickWand *wand = 0;
+  int64_t start;
+  int ix;
+
+  for(ix = 0; ix < g_bench.iterations; ix++) {
+    if(wand) {
+      DestroyMagickWand(wand);
+    }
+    wand = NewMagickWand();
+    lseek(file, 0, SEEK_SET);
+    start = now_ns();
+    image_start(wand, dup(file), 0, 0);
+    timing_add(&t, now_ns() - start);
+  }
+  t.bytes = size;
+  report("decode", "format", format, width, height, &t);
+  return wand;
+}
+
+void bench_encode(MagickWand *decoded, const char *format, int width, int height) {
+  struct timing t = { 0 };
+  MagickWand *wand;
+  unsigned char *blob;
+  char quality[] = "80";
+  size_t size;
+  int64_t start;
+  int ix;
+
+  for(ix = 0; ix < g_bench.iterations; ix++) {
+    wand = CloneMagickWand(decoded);
+    start = now_ns();
+    image_quality(wand, quality);
+    blob = image_end(wand, format, &size);
+    timing_add(&t, now_ns() - start);
+    t.bytes = size;
+    MagickRelinquishMemory(blob);
+    DestroyMagickWand(wand);
+  }
+  report("encode", "format", format, width, height, &t);
+}
+
+void bench_resize(MagickWand *source, int width, int height) {
+  struct timing t;
+  MagickWand *wand;
+  char
+    directive[32],
+    scale[16];
+  int64_t start;
+  int
+    is,
+    ix;
+
+  for(is = 0; g_scales[is]; is++) {
+    memset(&t, 0, sizeof(t));
+    for(ix = 0; ix < g_bench.iterations; ix++) {
+      wand = CloneMagickWand(source);
+      snprintf(directive, sizeof(directive), "%dx%d",
+        (int) (width * g_scales[is]), (int) (height * g_scales[is]));
+      start = now_ns();
+      image_resize(wand, directive);
+      timing_add(&t, now_ns() - start);
+      DestroyMagickWand(wand);
+    }
+    snprintf(scale, sizeof(scale), "%g", g_scales[is]);
+    report("resize", "scale", scale, width, height, &t);
+  }
+
+  for(is = 0; g_filters[is].name; is++) {
+    memset(&t, 0, sizeof(t));
+    for(ix = 0; ix < g_bench.iterations; ix++) {
+      wand = CloneMagickWand(source);
+      start = now_ns();
+      MagickResizeImage(wand, width / 2, height / 2, g_filters[is].filter, 1.0);
+      timing_add(&t, now_ns() - start);
+      DestroyMagickWand(wand);
+    }
+    report("magick_resize", "filter", g_filters[is].name, width, height, &t);
+  }
+}
+
+// A tile from the middle, at the sizes the grid in sample/index.html uses
+void bench_crop(MagickWand *source, int width, int height) {
+  const int tiles[] = { 16, 64, 256, 0 };
+  struct timing t;
+  MagickWand *wand;
+  char
+    directive[64],
+    tile[16];
+  int64_t start;
+  int
+    it,
+    ix;
+
+  for(it = 0; tiles[it] && tiles[it] <= width && tiles[it] <= height; it++) {
+    memset(&t, 0, sizeof(t));
+    for(ix = 0; ix < g_bench.iterations; ix++) {
+      wand = CloneMagickWand(source);
+      snprintf(directive, sizeof(directive), "%dx%dp%dp%d",
+        tiles[it], tiles[it], (height - tiles[it]) / 2, (width - tiles[it]) / 2);
+      start = now_ns();
+      image_offset(wand, directive);
+      timing_add(&t, now_ns() - start);
+      DestroyMagickWand(wand);
+    }
+    snprintf(tile, sizeof(tile), "%d", tiles[it]);
+    report("crop", "tile", tile, width, height, &t);
+  }
+}
+
+// A 64 pixel tile from the middle of a resize to about 90%, of the source
+// as it is, in gray and with an alpha channel.  The resize is to a size
+// that shares nothing with the original's, so image_region resamples just
+// the tile.  Both ways are timed, and the tile is checked against
+// resizing everything and cropping, to a couple of levels in 8 bits and
+// on the same canvas.
+void bench_region(MagickWand *source, int width, int height) {
+  const char *kinds[] = { "rgb", "gray", "alpha", 0 };
+  struct timing 
+    whole,
+    region;
+
+  MagickWand 
+    *kind,
+    *mask,
+    *wand,
+    *made[2];
+
+  char 
+    resize[32],
+    crop[32],
+    directive[64];
+
+  double 
+    diff,
+    psnr;
+
+  int64_t start;
+  int 
+    to_width = width * 9 / 10,
+    to_height = height * 9 / 10,
+    ik,
+    ix;
+
+  while(to_width > 1 && gcd(width, to_width) != 1) {
+    to_width--;
+  }
+  while(to_height > 1 && gcd(height, to_height) != 1) {
+    to_height--;
+  }
+  if(to_width < 128 || to_height < 128) {
+    return;
+  }
+  snprintf(resize, sizeof(resize), "%dx%d", to_width, to_height);
+  snprintf(crop, sizeof(crop), "64x64p%dp%d", (to_height - 64) / 2, (to_width - 64) / 2);
+  snprintf(directive, sizeof(directive), "%so%s", resize, crop);
+
+  for(ik = 0; kinds[ik]; ik++) {
+    kind = CloneMagickWand(source);
+    if(ik == 1) {
+      MagickTransformImageColorspace(kind, GRAYColorspace);
+    } else if(ik == 2) {
+      mask = NewMagickWand();
+      MagickSetSize(mask, width, height);
+      MagickReadImage(mask, "gradient:white-black");
+      MagickSetImageAlphaChannel(kind, SetAlphaChannel);
+      MagickCompositeImage(kind, mask, CopyOpacityCompositeOp, 0, 0);
+      DestroyMagickWand(mask);
+    }
+
+    memset(&whole, 0, sizeof(whole));
+    memset(&region, 0, sizeof(region));
+    made[0] = made[1] = 0;
+    for(ix = 0; ix < g_bench.iterations; ix++) {
+      wand = CloneMagickWand(kind);
+      start = now_ns();
+      image_resize(wand, resize);
+      image_offset(wand, crop);
+      timing_add(&whole, now_ns() - start);
+      if(made[0]) {
+        DestroyMagickWand(wand);
+      } else {
+        made[0] = wand;
+      }
+
+      wand = CloneMagickWand(kind);
+      start = now_ns();
+      image_region(wand, directive);
+      timing_add(&region, now_ns() - start);
+      if(made[1]) {
+        DestroyMagickWand(wand);
+      } else {
+        made[1] = wand;
+      }
+    }
+    report("resize_crop", "source", kinds[ik], width, height, &whole);
+    report("region", "source", kinds[ik], width, height, &region);
+
+    diff = image_diff(made[1], made[0], &psnr);
+    report_check("region_check", "source", kinds[ik], width, height, diff, psnr, 2.0 / 255);
+    DestroyMagickWand(made[0]);
+    DestroyMagickWand(made[1]);
+    DestroyMagickWand(kind);
+  }
+}
+
+// chain, directives in the order they're done and split by _, as planned
+// and as asked for
+void check_chain(MagickWand *source, const char *chain, double tolerance, int width, int height) {
+  MagickWand 
+    *planned = CloneMagickWand(source),
+    *literal = CloneMagickWand(source);
+
+  char 
+    copy[256],
+    plan[MAX_CHAIN * 2][PLAN_LEN],
+    *commandList[MAX_CHAIN],
+    *tok;
+
+  double 
+    diff,
+    psnr;
+
+  int 
+    left[MAX_CHAIN * 2],
+    count = 0,
+    steps,
+    ix;
+
+  snprintf(copy, sizeof(copy), "%s", chain);
+  for(tok = strtok(copy, "_"); tok && count < MAX_CHAIN; tok = strtok(0, "_")) {
+    image_directive(literal, tok);
+    commandList[count++] = tok;
+  }
+
+  // the plan wants them last first, as they are in a name
+  for(ix = 0; ix < count / 2; ix++) {
+    tok = commandList[ix];
+    commandList[ix] = commandList[count - 1 - ix];
+    commandList[count - 1 - ix] = tok;
+  }
+  steps = plan_make(planned, commandList, count, "png", plan, left);
+  for(ix = 0; ix < steps; ix++) {
+    image_directive(planned, plan[ix]);
+  }
+
+  diff = image_diff(planned, literal, &psnr);
+  report_check("check", "chain", chain, width, height, diff, psnr, tolerance);
+  DestroyMagickWand(planned);
+  DestroyMagickWand(literal);
+}
+
+// Recipes that plan_make changes.  Cutting out part of the image before
+// resizing it makes the same pixels, give or take rounding; resampling
+// just the crop is allowed a couple of levels in 8 bits.
+void bench_plan(MagickWand *source, int width, int height) {
+  char chain[256];
+  int 
+    to_width = width * 9 / 10,
+    to_height = height * 9 / 10;
+
+  // sizes that share nothing with the original's, so no part of it maps
+  // onto whole pixels of the resize
+  while(to_width > 1 && gcd(width, to_width) != 1) {
+    to_width--;
+  }
+  while(to_height > 1 && gcd(height, to_height) != 1) {
+    to_height--;
+  }
+  if(to_width < 128 || to_height < 128) {
+    return;
+  }
+
+  snprintf(chain, sizeof(chain), "r%dx%d_o64x64p%dp%d", 
+    width / 2, height / 2, (height / 2 - 64) / 2, (width / 2 - 64) / 2);
+  check_chain(source, chain, 1e-4, width, height);
+
+  snprintf(chain, sizeof(chain), "r%dx%d_o64x64p%dp%d", 
+    to_width, to_height, (to_height - 64) / 2, (to_width - 64) / 2);
+  check_chain(source, chain, 2.0 / 255, width, height);
+
+  snprintf(chain, sizeof(chain), "r%dx%d_o%dx%dp0p0", 
+    to_width, to_height, to_height - 2, to_width - 2);
+  check_chain(source, chain, 1e-4, width, height);
+
+  snprintf(chain, sizeof(chain), "o%dx%dp10p10_r%dx%d_o%dx%dp10p10", 
+    height - 20, width - 20, width / 2, height / 2, height / 4, width / 4);
+  check_chain(source, chain, 1e-4, width, height);
+
+  snprintf(chain, sizeof(chain), "r%dx%d_o%dx%dp0p0", 
+    width, height, height, width);
+  check_chain(source, chain, 1e-4, width, height);
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+    "usage: %s [-n iterations] [-s WxH,...] [-f FORMAT,...]\n"
+    "\n"
+    "  -n  times each op runs (5)\n"
+    "  -s  sizes of the originals (320x240,1024x768,4000x3000)\n"
+    "  -f  formats to decode and encode (JPEG,PNG,GIF,BMP)\n",
+    self);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  MagickWand
+    *source,
+    *decoded;
+
+  char
+    sizes[] = "320x240,1024x768,4000x3000",
+    formats[] = "JPEG,PNG,GIF,BMP",
+    *size_list = sizes,
+    *format_list = formats,
+    *tok;
+
+  size_t bytes;
+
+  int
+    opt,
+    is,
+    ifmt,
+    file;
+
+  while((opt = getopt(argc, argv, "n:s:f:")) != -1) {
+    switch(opt) {
+      case 'n': g_bench.iterations = atoi(optarg); break;
+      case 's': size_list = optarg; break;
+      case 'f': format_list = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(g_bench.iterations < 1) {
+    usage(argv[0]);
+  }
+
+  for(tok = strtok(size_list, ","); tok && g_bench.sizes < MAX_SIZES; tok = strtok(0, ",")) {
+    if(sscanf(tok, "%dx%d", &g_bench.width[g_bench.sizes], &g_bench.height[g_bench.sizes]) != 2) {
+      usage(argv[0]);
+    }
+    g_bench.sizes++;
+  }
+  for(tok = strtok(format_list, ","); tok && g_bench.formats < MAX_FORMATS; tok = strtok(0, ",")) {
+    g_bench.format[g_bench.formats++] = tok;
+  }
+
+  plog0 = plog1 = plog2 = plog3 = log_fake;
+  MagickWandGenesis();
+
+  for(is = 0; is < g_bench.sizes; is++) {
+    source = make_source(g_bench.width[is], g_bench.height[is]);
+
+    for(ifmt = 0; ifmt < g_bench.formats; ifmt++) {
+      file = make_file(source, g_bench.format[ifmt], &bytes);
+      decoded = bench_decode(file, bytes, g_bench.format[ifmt], g_bench.width[is], g_bench.height[is]);
+      close(file);
+      bench_encode(decoded, g_bench.format[ifmt], g_bench.width[is], g_bench.height[is]);
+      DestroyMagickWand(decoded);
+    }
+
+    bench_resize(source, g_bench.width[is], g_bench.height[is]);
+    bench_crop(source, g_bench.width[is], g_bench.height[is]);
+    bench_region(source, g_bench.width[is], g_bench.height[is]);
+    bench_plan(source, g_bench.width[is], g_bench.height[is]);
+
+    DestroyMagickWand(source);
+  }
+
+  MagickWandTerminus();
+  return g_bench.failed;
+}
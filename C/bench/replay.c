@@ -0,0 +1,435 @@
+// Replays an access log against apophnia, for capacity testing
+//
+// Reads mongoose's access_log_file lines
+//
+//   127.0.0.1 - - [19/Oct/2026:10:00:01 +0000] "GET /example_r320x240.jpg HTTP/1.1" 200 ...
+//
+// or apophnia's own with access_log set
+//
+//   [ 1792404001.123456 ] access uri=/example_r320x240.jpg status=200 cache=MISS ...
+//
+// from the files named, or stdin, and asks for every GET in it again, in
+// the order and with the gaps between them that the log has.  -x runs the
+// log faster or slower than it happened, and -x 0 as fast as the
+// connections allow.  Mongoose only logs to the second, so requests in
+// the same second are spread evenly over it.
+//
+//   make bench
+//   bench/replay -p 1210 -c 64 -x 10 access.log > replay.json
+//
+// prints latency percentiles, how far behind the log the replay fell,
+// statuses, the X-Cache outcomes with the hit ratio they make, and how
+// many transforms were done with the directives they ran.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "http.h"
+
+#define MAX_URL       1024
+#define MAX_STATUS    600
+
+#define O_HIT         0
+#define O_MISS        1
+#define O_STALE       2
+#define O_DEGRADED    3
+#define O_SHED        4
+#define O_NONE        5
+#define O_COUNT       6
+
+const char *g_outcomes[] = { "HIT", "MISS", "STALE", "DEGRADED", "SHED", "NONE" };
+
+// directives by their letter, and everything else
+const char g_directives[] = "roq";
+#define D_COUNT       4
+
+struct {
+  char *host;
+
+  int
+    port,
+    concurrency,
+    keep_alive,
+    limit;
+
+  double speedup;
+} g_opts = {
+  "127.0.0.1", 1210, 16, 1, 0, 1.0
+};
+
+struct entry {
+  // from the start of the log
+  int64_t at_us;
+
+  int
+    line,
+    coarse;
+
+  char *uri;
+};
+
+struct entry *g_entries = 0;
+int g_entry_count = 0;
+
+volatile int g_next = 0;
+int64_t g_start;
+
+struct client {
+  pthread_t thread;
+  struct http_client http;
+
+  int
+    count,
+    size;
+
+  int64_t
+    *latency,
+    bytes,
+    errors,
+    lag_max,
+    lag_sum,
+    status[MAX_STATUS],
+    outcome[O_COUNT],
+    directive[D_COUNT];
+};
+
+void entry_add(int64_t at_us, int coarse, const char *uri, int len) {
+  static int size = 0;
+  struct entry *entry;
+
+  if(len <= 0 || len >= MAX_URL) {
+    return;
+  }
+  if(g_entry_count == size) {
+    size = size ? size * 2 : 4096;
+    g_entries = realloc(g_entries, size * sizeof(struct entry));
+  }
+  entry = &g_entries[g_entry_count];
+  entry->at_us = at_us;
+  entry->coarse = coarse;
+  entry->line = g_entry_count++;
+  entry->uri = strndup(uri, len);
+}
+
+// [ sec.usec ] access uri=... status=...
+int parse_apophnia(const char *line) {
+  long long
+    sec,
+    usec;
+
+  const char *uri;
+
+  if(sscanf(line, "[ %lld.%lld ]", &sec, &usec) != 2 || !(uri = strstr(line, " ] access uri="))) {
+    return 0;
+  }
+  uri += 14;
+  entry_add(sec * 1000000 + usec, 0, uri, strcspn(uri, " \n"));
+  return 1;
+}
+
+// host - user [dd/Mon/YYYY:HH:MM:SS +zone] "GET /uri HTTP/1.1" status bytes
+int parse_mongoose(const char *line) {
+  struct tm tm;
+  const char
+    *date = strchr(line, '['),
+    *request,
+    *uri;
+
+  memset(&tm, 0, sizeof(tm));
+  if(!date || !(request = strptime(date + 1, "%d/%b/%Y:%H:%M:%S %z]", &tm))) {
+    return 0;
+  }
+  if(!(request = strstr(request, "\"GET "))) {
+    return 0;
+  }
+  uri = request + 5;
+  entry_add((timegm(&tm) - tm.tm_gmtoff) * (int64_t) 1000000, 1, uri, strcspn(uri, " \""));
+  return 1;
+}
+
+void read_log(FILE *fp) {
+  char line[MAX_URL * 4];
+
+  while(fgets(line, sizeof(line), fp)) {
+    if(!parse_apophnia(line)) {
+      parse_mongoose(line);
+    }
+  }
+}
+
+// by time, and in the order they were logged within the same time
+int compare_entry(const void *a, const void *b) {
+  const struct entry
+    *left = (const struct entry*) a,
+    *right = (const struct entry*) b;
+
+  if(left->at_us != right->at_us) {
+    return left->at_us < right->at_us ? -1 : 1;
+  }
+  return left->line - right->line;
+}
+
+// Sorted, from 0, with runs of the same second spread over the second
+void make_schedule() {
+  int64_t first;
+  int
+    ix,
+    ir,
+    run;
+
+  qsort(g_entries, g_entry_count, sizeof(struct entry), compare_entry);
+  if(g_opts.limit && g_opts.limit < g_entry_count) {
+    g_entry_count = g_opts.limit;
+  }
+
+  first = g_entry_count ? g_entries[0].at_us : 0;
+  for(ix = 0; ix < g_entry_count; ix += run) {
+    for(run = 1; ix + run < g_entry_count && g_entries[ix].coarse &&
+        g_entries[ix + run].at_us == g_entries[ix].at_us; run++);
+
+    for(ir = 0; ir < run; ir++) {
+      g_entries[ix + ir].at_us += (int64_t) ir * 1000000 / run * g_entries[ix].coarse - first;
+    }
+  }
+}
+
+// The directives in /name_r320x240_q80.jpg, counted by their letter
+void count_directives(struct client *client, const char *uri) {
+  const char *dir;
+  char *letter;
+
+  for(dir = strchr(uri, '_'); dir; dir = strchr(dir + 1, '_')) {
+    if(!dir[1] || dir[1] == '.' || dir[1] == '_') {
+      continue;
+    }
+    letter = strchr(g_directives, dir[1]);
+    client->directive[letter ? letter - g_directives : D_COUNT - 1]++;
+  }
+}
+
+void *client_run(void *arg) {
+  struct client *client = (struct client*) arg;
+  struct http_response response;
+  struct timespec wait;
+  struct entry *entry;
+
+  int64_t
+    start,
+    due,
+    lag;
+
+  int
+    ix,
+    io;
+
+  while((ix = __sync_fetch_and_add(&g_next, 1)) < g_entry_count) {
+    entry = &g_entries[ix];
+    start = now_ns();
+
+    if(g_opts.speedup > 0) {
+      due = g_start + (int64_t) (entry->at_us * 1000 / g_opts.speedup);
+      if(start < due) {
+        wait.tv_sec = (due - start) / 1000000000;
+        wait.tv_nsec = (due - start) % 1000000000;
+        nanosleep(&wait, 0);
+        start = now_ns();
+      }
+      lag = start - due;
+      client->lag_sum += lag;
+      if(lag > client->lag_max) {
+        client->lag_max = lag;
+      }
+    }
+
+    if(http_get(&client->http, entry->uri, &response)) {
+      client->errors++;
+      continue;
+    }
+    if(client->count == client->size) {
+      client->size = client->size ? client->size * 2 : 4096;
+      client->latency = realloc(client->latency, client->size * sizeof(int64_t));
+    }
+    client->latency[client->count++] = now_ns() - start;
+    client->bytes += response.bytes;
+    client->status[response.status > 0 && response.status < MAX_STATUS ? response.status : 0]++;
+
+    for(io = 0; io < O_NONE && strcmp(g_outcomes[io], response.cache); io++);
+    client->outcome[io]++;
+    if(io == O_MISS) {
+      count_directives(client, entry->uri);
+    }
+  }
+  return 0;
+}
+
+void usage(const char *self) {
+  fprintf(stderr,
+    "usage: %s [-h host] [-p port] [-c connections] [-K] [-x speedup] [-n limit] [log ...]\n"
+    "\n"
+    "  -h  server address (127.0.0.1)\n"
+    "  -p  server port (1210)\n"
+    "  -c  concurrent connections (16)\n"
+    "  -K  a new connection for every request instead of keep-alive\n"
+    "  -x  how many times faster than the log to go, or 0 for as fast as\n"
+    "      possible (1)\n"
+    "  -n  replay only the first this many requests (all)\n"
+    "\n"
+    "Logs are mongoose's access_log_file or apophnia's access_log lines,\n"
+    "from stdin if none are named.\n",
+    self);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  const char *names[] = { "p50_ms", "p90_ms", "p99_ms", "p999_ms" };
+
+  struct client
+    *clients,
+    total;
+
+  FILE *fp;
+
+  int64_t
+    *all,
+    served,
+    hits,
+    end;
+
+  int
+    opt,
+    count = 0,
+    first,
+    ix,
+    is;
+
+  double seconds;
+
+  while((opt = getopt(argc, argv, "h:p:c:Kx:n:")) != -1) {
+    switch(opt) {
+      case 'h': g_opts.host = optarg; break;
+      case 'p': g_opts.port = atoi(optarg); break;
+      case 'c': g_opts.concurrency = atoi(optarg); break;
+      case 'K': g_opts.keep_alive = 0; break;
+      case 'x': g_opts.speedup = atof(optarg); break;
+      case 'n': g_opts.limit = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if(g_opts.concurrency < 1 || g_opts.speedup < 0 || g_opts.limit < 0) {
+    usage(argv[0]);
+  }
+
+  if(optind == argc) {
+    read_log(stdin);
+  }
+  for(ix = optind; ix < argc; ix++) {
+    if(!(fp = fopen(argv[ix], "r"))) {
+      fprintf(stderr, "Can't read %s\n", argv[ix]);
+      return 1;
+    }
+    read_log(fp);
+    fclose(fp);
+  }
+  if(!g_entry_count) {
+    fprintf(stderr, "Nothing to replay\n");
+    return 1;
+  }
+  make_schedule();
+
+  if(!http_resolve(g_opts.host, g_opts.port)) {
+    fprintf(stderr, "Can't resolve %s\n", g_opts.host);
+    return 1;
+  }
+
+  clients = calloc(g_opts.concurrency, sizeof(struct client));
+  g_start = now_ns();
+  for(ix = 0; ix < g_opts.concurrency; ix++) {
+    http_init(&clients[ix].http, g_opts.keep_alive);
+    pthread_create(&clients[ix].thread, 0, client_run, &clients[ix]);
+  }
+  for(ix = 0; ix < g_opts.concurrency; ix++) {
+    pthread_join(clients[ix].thread, 0);
+    count += clients[ix].count;
+  }
+  end = now_ns();
+
+  memset(&total, 0, sizeof(total));
+  all = malloc((count + 1) * sizeof(int64_t));
+  for(ix = 0; ix < g_opts.concurrency; ix++) {
+    memcpy(all + total.count, clients[ix].latency, clients[ix].count * sizeof(int64_t));
+    total.count += clients[ix].count;
+    total.bytes += clients[ix].bytes;
+    total.errors += clients[ix].errors;
+    total.lag_sum += clients[ix].lag_sum;
+    if(clients[ix].lag_max > total.lag_max) {
+      total.lag_max = clients[ix].lag_max;
+    }
+    for(is = 0; is < MAX_STATUS; is++) {
+      total.status[is] += clients[ix].status[is];
+    }
+    for(is = 0; is < O_COUNT; is++) {
+      total.outcome[is] += clients[ix].outcome[is];
+    }
+    for(is = 0; is < D_COUNT; is++) {
+      total.directive[is] += clients[ix].directive[is];
+    }
+  }
+  qsort(all, count, sizeof(int64_t), compare_int64);
+  seconds = (end - g_start) / 1e9;
+
+  // everything the cache answered for, whether or not it had it
+  served = total.outcome[O_HIT] + total.outcome[O_MISS] + total.outcome[O_STALE] + total.outcome[O_DEGRADED];
+  hits = total.outcome[O_HIT] + total.outcome[O_STALE];
+
+  printf("{\n");
+  printf("  \"host\": \"%s\",\n", g_opts.host);
+  printf("  \"port\": %d,\n", g_opts.port);
+  printf("  \"connections\": %d,\n", g_opts.concurrency);
+  printf("  \"keep_alive\": %d,\n", g_opts.keep_alive);
+  printf("  \"speedup\": %g,\n", g_opts.speedup);
+  printf("  \"log_seconds\": %.3f,\n", g_entries[g_entry_count - 1].at_us / 1e6);
+  printf("  \"requests\": %d,\n", count);
+  printf("  \"errors\": %lld,\n", (long long) total.errors);
+  printf("  \"bytes\": %lld,\n", (long long) total.bytes);
+  printf("  \"seconds\": %.3f,\n", seconds);
+  printf("  \"requests_per_second\": %.1f,\n", seconds > 0 ? count / seconds : 0);
+  for(ix = 0; ix < 4; ix++) {
+    printf("  \"%s\": %.3f,\n", names[ix], count ? all[QUANTILE(count, quantiles[ix])] / 1e6 : 0);
+  }
+  printf("  \"max_ms\": %.3f,\n", count ? all[count - 1] / 1e6 : 0);
+  printf("  \"lag_mean_ms\": %.3f,\n", g_opts.speedup > 0 ? total.lag_sum / 1e6 / g_entry_count : 0);
+  printf("  \"lag_max_ms\": %.3f,\n", total.lag_max / 1e6);
+
+  printf("  \"status\": {");
+  for(first = 1, is = 0; is < MAX_STATUS; is++) {
+    if(total.status[is]) {
+      printf("%s \"%d\": %lld", first ? "" : ",", is, (long long) total.status[is]);
+      first = 0;
+    }
+  }
+  printf(" },\n");
+
+  printf("  \"cache\": {");
+  for(is = 0; is < O_COUNT; is++) {
+    printf("%s \"%s\": %lld", is ? "," : "", g_outcomes[is], (long long) total.outcome[is]);
+  }
+  printf(" },\n");
+  printf("  \"hit_ratio\": %.4f,\n", served ? (double) hits / served : 0);
+
+  printf("  \"transforms\": %lld,\n", (long long) total.outcome[O_MISS]);
+  printf("  \"directives\": {");
+  for(is = 0; is < D_COUNT - 1; is++) {
+    printf(" \"%c\": %lld,", g_directives[is], (long long) total.directive[is]);
+  }
+  printf(" \"other\": %lld }\n", (long long) total.directive[D_COUNT - 1]);
+  printf("}\n");
+
+  free(all);
+  return 0;
+}
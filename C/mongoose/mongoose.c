@@ -23,6 +23,7 @@
 #else
 #ifdef __linux__
 #define _XOPEN_SOURCE 600     // For flockfile() on Linux
+#define _GNU_SOURCE           // For accept4() on Linux
 #endif
 #define _LARGEFILE_SOURCE     // Enable 64-bit file offsets
 #define __STDC_FORMAT_MACROS  // <inttypes.h> wants this for C++
@@ -148,6 +149,7 @@ typedef long off_t;
 typedef HANDLE pthread_mutex_t;
 typedef struct {HANDLE signal, broadcast;} pthread_cond_t;
 typedef DWORD pthread_t;
+typedef HANDLE sem_t;
 #define pid_t HANDLE // MINGW typedefs pid_t to int. Using #define here.
 
 static int pthread_mutex_lock(pthread_mutex_t *);
@@ -203,11 +205,19 @@ struct pollfd {
 
 #include <pwd.h>
 #include <unistd.h>
+#include <semaphore.h>
 #include <dirent.h>
 #if !defined(NO_SSL_DL) && !defined(NO_SSL)
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#if !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -277,6 +287,17 @@ static pthread_t pthread_self(void) {
 #endif // DEBUG
 #endif // DEBUG_TRACE
 
+// Static tracepoints for perf and bpftrace, under the "mongoose" provider.
+// They cost a nop when nothing is attached.
+#if defined(HAVE_SDT)
+#include <sys/sdt.h>
+#define MG_PROBE1(name, a) DTRACE_PROBE1(mongoose, name, a)
+#define MG_PROBE2(name, a, b) DTRACE_PROBE2(mongoose, name, a, b)
+#else
+#define MG_PROBE1(name, a)
+#define MG_PROBE2(name, a, b)
+#endif // HAVE_SDT
+
 // Darwin prior to 7.0 and Win32 do not have socklen_t
 #ifdef NO_SOCKLEN_T
 typedef int socklen_t;
@@ -423,20 +444,22 @@ struct socket {
   union usa rsa;        // Remote socket address
   unsigned is_ssl:1;    // Is port SSL-ed
   unsigned ssl_redir:1; // Is port supposed to redirect everything to SSL port
+  int64_t queued_ns;    // Time spent in the accept queue before this request
 };
 
 // NOTE(lsm): this enum shoulds be in sync with the config_options below.
 enum {
-  CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
+  ACCEPT_THREADS, CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
   PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, THROTTLE,
   ACCESS_LOG_FILE, ENABLE_DIRECTORY_LISTING, ERROR_LOG_FILE,
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
-  EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
+  EXTRA_MIME_TYPES, LISTENING_PORTS, QUEUE_DEPTH, DOCUMENT_ROOT, SSL_CERTIFICATE,
   NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
   NUM_OPTIONS
 };
 
 static const char *config_options[] = {
+  "A", "accept_threads", "0",
   "C", "cgi_pattern", "**.cgi$|**.pl$|**.php$",
   "E", "cgi_environment", NULL,
   "G", "put_delete_auth_file", NULL,
@@ -454,6 +477,7 @@ static const char *config_options[] = {
   "l", "access_control_list", NULL,
   "m", "extra_mime_types", NULL,
   "p", "listening_ports", "8080",
+  "q", "queue_depth", "256",
   "r", "document_root",  ".",
   "s", "ssl_certificate", NULL,
   "t", "num_threads", "20",
@@ -479,12 +503,55 @@ struct mg_context {
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
-  struct socket queue[20];   // Accepted sockets
-  volatile int sq_head;      // Head of the socket queue
-  volatile int sq_tail;      // Tail of the socket queue
-  pthread_cond_t sq_full;    // Signaled when socket is produced
-  pthread_cond_t sq_empty;   // Signaled when socket is consumed
+  struct sq_cell *queue;     // Accepted sockets, bounded MPMC ring
+  unsigned sq_mask;          // Ring size - 1, ring size is a power of 2
+  volatile unsigned sq_head; // Next cell to produce into
+  volatile unsigned sq_tail; // Next cell to consume from
+  sem_t sq_items;            // Counts queued sockets
+  sem_t sq_slots;            // Counts free slots, up to queue_depth
+  volatile int64_t sq_count;    // Sockets consumed from the queue
+  volatile int64_t sq_wait_ns;  // Total time sockets spent queued
+  volatile int64_t sq_wait_max; // Longest time a socket spent queued
+
+#if defined(USE_EPOLL)
+  struct acceptor *acceptors;   // One per SO_REUSEPORT listener set
+  int num_acceptors;
+  volatile int num_acceptors_running; // Protected by mutex
+#endif
+};
+
+// Vyukov's bounded MPMC queue cell. seq == position means free for the
+// producer of that position, seq == position + 1 means ready to consume.
+struct sq_cell {
+  volatile unsigned seq;
+  struct socket so;
+  int64_t enqueued;          // mg_clock_ns() when produced
+};
+
+#if defined(USE_EPOLL)
+// A keep-alive socket waiting in the reactor for its next request.
+struct parked {
+  struct socket so;
+  time_t since;
+  struct parked *prev, *next;
+};
+
+// Acceptor thread with its own listening sockets and epoll instance.
+struct acceptor {
+  struct mg_context *ctx;
+  struct socket *listeners;  // Points into ctx->listening_sockets
+  int num_listeners;
+  int epoll_fd;
+  pthread_mutex_t mutex;     // Protects parked list
+  struct parked *parked;     // Idle keep-alive sockets, oldest first
+  struct parked *parked_tail;
+  int num_parked;
+  struct parked *ready;      // Readable, waiting for a queue slot
+  struct parked *ready_tail;
+  int listening;             // Listeners armed in epoll
+  int accept_retry;          // accept4() stopped short, retry next tick
 };
+#endif
 
 struct mg_connection {
   struct mg_request_info request_info;
@@ -981,6 +1048,20 @@ static int pthread_cond_destroy(pthread_cond_t *cv) {
   return CloseHandle(cv->signal) && CloseHandle(cv->broadcast) ? 0 : -1;
 }
 
+static int sem_init(sem_t *sem, int unused, unsigned value) {
+  unused = 0;
+  *sem = CreateSemaphore(NULL, (LONG) value, 0x7fffffff, NULL);
+  return *sem == NULL ? -1 : 0;
+}
+
+static int sem_post(sem_t *sem) {
+  return ReleaseSemaphore(*sem, 1, NULL) == 0 ? -1 : 0;
+}
+
+static int sem_destroy(sem_t *sem) {
+  return CloseHandle(*sem) == 0 ? -1 : 0;
+}
+
 // For Windows, change all slashes to backslashes in path names.
 static void change_slashes_to_backslashes(char *path) {
   int i;
@@ -2814,6 +2895,58 @@ void mg_send_file(struct mg_connection *conn, const char *path) {
   }
 }
 
+long long mg_send_fd(struct mg_connection *conn, int fd, long long offset,
+                     long long len) {
+  char buf[MG_BUF_LEN];
+  long long total = 0;
+  int to_read, n;
+
+#if defined(__linux__)
+  off_t off = (off_t) offset;
+  ssize_t sent;
+
+  // The kernel can copy straight from the page cache to a plain socket
+  if (conn->ssl == NULL && conn->throttle <= 0) {
+    while (total < len && conn->ctx->stop_flag == 0) {
+      sent = sendfile(conn->client.sock, fd, &off, (size_t) (len - total));
+      if (sent < 0 && errno == EINTR) {
+        continue;
+      } else if (sent <= 0) {
+        break;
+      }
+      total += sent;
+    }
+    conn->num_bytes_sent += total;
+    return total;
+  }
+#endif
+
+  while (total < len) {
+    to_read = sizeof(buf);
+    if ((long long) to_read > len - total) {
+      to_read = (int) (len - total);
+    }
+#if defined(_WIN32)
+    if (_lseeki64(fd, offset + total, SEEK_SET) < 0 ||
+        (n = read(fd, buf, (unsigned) to_read)) <= 0) {
+      break;
+    }
+#else
+    if ((n = (int) pread(fd, buf, (size_t) to_read,
+                         (off_t) (offset + total))) <= 0) {
+      break;
+    }
+#endif
+    if (mg_write(conn, buf, (size_t) n) != n) {
+      break;
+    }
+    total += n;
+  }
+  conn->num_bytes_sent += total;
+
+  return total;
+}
+
 
 // Parse HTTP headers from the given buffer, advance buffer to the point
 // where parsing stopped.
@@ -4316,6 +4449,27 @@ static int parse_port_string(const struct vec *vec, struct socket *so) {
   return 1;
 }
 
+#if defined(USE_EPOLL)
+// Whether another process already listens on so's address with
+// SO_REUSEPORT. Ours would then silently share its connections, so bind
+// without the option first, to fail the way a plain listener would.
+static int port_taken(const struct socket *so) {
+  int on = 1, taken, err;
+  SOCKET sock = socket(so->lsa.sa.sa_family, SOCK_STREAM, 6);
+
+  if (sock == INVALID_SOCKET) {
+    return 1;
+  }
+  taken = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                     (void *) &on, sizeof(on)) != 0 ||
+          bind(sock, &so->lsa.sa, sizeof(so->lsa)) != 0;
+  err = ERRNO;
+  closesocket(sock);
+  errno = err;
+  return taken;
+}
+#endif
+
 static int set_ports_option(struct mg_context *ctx) {
   const char *list = ctx->config[LISTENING_PORTS];
   int on = 1, success = 1;
@@ -4336,6 +4490,13 @@ static int set_ports_option(struct mg_context *ctx) {
                // broadcast UDP sockets
                setsockopt(so.sock, SOL_SOCKET, SO_REUSEADDR,
                           (void *) &on, sizeof(on)) != 0 ||
+#if defined(USE_EPOLL)
+               // Lets set_acceptors() open per-acceptor copies
+               (atoi(ctx->config[ACCEPT_THREADS]) != 1 &&
+                (port_taken(&so) ||
+                 setsockopt(so.sock, SOL_SOCKET, SO_REUSEPORT,
+                            (void *) &on, sizeof(on)) != 0)) ||
+#endif
                bind(so.sock, &so.lsa.sa, sizeof(so.lsa)) != 0 ||
                listen(so.sock, SOMAXCONN) != 0) {
       cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
@@ -4783,6 +4944,84 @@ struct mg_connection *mg_download(const char *host, int port, int use_ssl,
   return conn;
 }
 
+#if defined(USE_EPOLL)
+// Parked list is ordered by park time, so idle expiry only looks at the head.
+// Must be called with acc->mutex held.
+static void unlink_parked(struct acceptor *acc, struct parked *p) {
+  if (p->prev != NULL) p->prev->next = p->next; else acc->parked = p->next;
+  if (p->next != NULL) p->next->prev = p->prev; else acc->parked_tail = p->prev;
+  acc->num_parked--;
+}
+
+// Hold so in acc's reactor until it is readable. Returns 1 if it was
+// parked; the reactor then owns it.
+static int park_socket(struct acceptor *acc, const struct socket *so) {
+  struct epoll_event ev;
+  struct parked *p;
+
+  if ((p = (struct parked *) calloc(1, sizeof(*p))) == NULL) {
+    return 0;
+  }
+  p->so = *so;
+  p->since = time(NULL);
+
+  // Link before epoll_ctl(): the reactor may see the event immediately
+  (void) pthread_mutex_lock(&acc->mutex);
+  p->prev = acc->parked_tail;
+  if (acc->parked_tail != NULL) acc->parked_tail->next = p;
+  else acc->parked = p;
+  acc->parked_tail = p;
+  acc->num_parked++;
+  (void) pthread_mutex_unlock(&acc->mutex);
+
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+  ev.data.ptr = p;
+  if (epoll_ctl(acc->epoll_fd, EPOLL_CTL_ADD, p->so.sock, &ev) != 0) {
+    (void) pthread_mutex_lock(&acc->mutex);
+    unlink_parked(acc, p);
+    (void) pthread_mutex_unlock(&acc->mutex);
+    free(p);
+    return 0;
+  }
+
+  DEBUG_TRACE(("parked socket %d", p->so.sock));
+  MG_PROBE1(park, (int) p->so.sock);
+  return 1;
+}
+
+// Hand an idle keep-alive socket back to a reactor instead of blocking a
+// worker thread on it. Returns 1 if the socket was parked; the connection
+// then no longer owns it. Returns 0 if this worker should keep serving.
+static int park_connection(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct pollfd pfd;
+
+  // Pipelined data is already buffered, or SSL state lives in conn->ssl
+  if (conn->data_len > 0 || conn->client.is_ssl || ctx->num_acceptors == 0) {
+    return 0;
+  }
+
+  // Next request has already arrived: cheaper to serve it right here
+  pfd.fd = conn->client.sock;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 0) > 0) {
+    return 0;
+  }
+
+  if (!park_socket(&ctx->acceptors[conn->client.sock % ctx->num_acceptors],
+                   &conn->client)) {
+    return 0;
+  }
+  conn->client.sock = INVALID_SOCKET;
+  return 1;
+}
+#else
+static int park_connection(struct mg_connection *conn) {
+  (void) conn;
+  return 0;
+}
+#endif // USE_EPOLL
+
 static void process_new_connection(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
   int keep_alive_enabled, keep_alive, discard_len;
@@ -4795,8 +5034,11 @@ static void process_new_connection(struct mg_connection *conn) {
   // to crule42.
   conn->data_len = 0;
   do {
+    MG_PROBE1(request__start, (int) conn->client.sock);
     if (!getreq(conn, ebuf, sizeof(ebuf))) {
       send_http_error(conn, 500, "Server Error", "%s", ebuf);
+      // request_info is left over from the previous request, don't trust it
+      conn->must_close = 1;
     } else if (!is_valid_uri(conn->request_info.uri)) {
       snprintf(ebuf, sizeof(ebuf), "Invalid URI: [%s]", ri->uri);
       send_http_error(conn, 400, "Bad Request", "%s", ebuf);
@@ -4813,6 +5055,9 @@ static void process_new_connection(struct mg_connection *conn) {
       }
       log_access(conn);
     }
+    MG_PROBE2(request__done, (int) conn->client.sock, conn->status_code);
+    // Only the first request after a hand-off waited in the queue
+    conn->client.queued_ns = 0;
     if (ri->remote_user != NULL) {
       free((void *) ri->remote_user);
     }
@@ -4824,7 +5069,7 @@ static void process_new_connection(struct mg_connection *conn) {
     keep_alive = should_keep_alive(conn);
 
     // Discard all buffered data for this request
-    discard_len = conn->content_len >= 0 &&
+    discard_len = conn->content_len >= 0 && conn->request_len >= 0 &&
       conn->request_len + conn->content_len < (int64_t) conn->data_len ?
       (int) (conn->request_len + conn->content_len) : conn->data_len;
     memmove(conn->buf, conn->buf + discard_len, conn->data_len - discard_len);
@@ -4835,37 +5080,149 @@ static void process_new_connection(struct mg_connection *conn) {
   } while (conn->ctx->stop_flag == 0 &&
            keep_alive_enabled &&
            conn->content_len >= 0 &&
-           keep_alive);
+           keep_alive &&
+           !park_connection(conn));
 }
 
-// Worker threads take accepted socket from the queue
-static int consume_socket(struct mg_context *ctx, struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
-  DEBUG_TRACE(("going idle"));
+static int64_t mg_clock_ns(void) {
+#if defined(_WIN32)
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (int64_t) ((double) now.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+#if defined(_MSC_VER)
+#define mg_cas(p, o, n) (InterlockedCompareExchange((volatile LONG *) (p), \
+      (LONG) (n), (LONG) (o)) == (LONG) (o))
+#define mg_cas64(p, o, n) (InterlockedCompareExchange64((p), (n), (o)) == (o))
+#define mg_add64(p, v) InterlockedExchangeAdd64((p), (v))
+#define mg_barrier() MemoryBarrier()
+#else
+#define mg_cas(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define mg_cas64(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define mg_add64(p, v) __sync_fetch_and_add((p), (v))
+#define mg_barrier() __sync_synchronize()
+#endif
+
+// Wait on a semaphore for at most ms milliseconds. Returns 1 if acquired.
+static int sem_wait_ms(sem_t *sem, int ms) {
+#if defined(_WIN32)
+  return WaitForSingleObject(*sem, (DWORD) ms) == WAIT_OBJECT_0;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long) (ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return sem_timedwait(sem, &ts) == 0;
+#endif
+}
+
+static int sq_init(struct mg_context *ctx) {
+  int depth = atoi(ctx->config[QUEUE_DEPTH]);
+  unsigned i, size = 2;
+
+  if (depth < 1) {
+    depth = 1;
+  }
+  while (size < (unsigned) depth) {
+    size <<= 1;
+  }
+  if ((ctx->queue = (struct sq_cell *) calloc(size, sizeof(ctx->queue[0]))) ==
+      NULL) {
+    return 0;
+  }
+  for (i = 0; i < size; i++) {
+    ctx->queue[i].seq = i;
+  }
+  ctx->sq_mask = size - 1;
+  return sem_init(&ctx->sq_items, 0, 0) == 0 &&
+    sem_init(&ctx->sq_slots, 0, (unsigned) depth) == 0;
+}
 
-  // If the queue is empty, wait. We're idle at this point.
-  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
-    pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
+// Lock-free push. Returns 0 if the cell at the head is still being consumed.
+static int sq_push(struct mg_context *ctx, const struct socket *sp) {
+  struct sq_cell *cell;
+  unsigned pos;
+  int dif;
+
+  for (;;) {
+    pos = ctx->sq_head;
+    cell = &ctx->queue[pos & ctx->sq_mask];
+    mg_barrier();
+    dif = (int) (cell->seq - pos);
+    if (dif == 0 && mg_cas(&ctx->sq_head, pos, pos + 1)) {
+      break;
+    } else if (dif < 0) {
+      return 0;
+    }
   }
+  cell->so = *sp;
+  cell->enqueued = mg_clock_ns();
+  mg_barrier();
+  cell->seq = pos + 1;
+  return 1;
+}
 
-  // If we're stopping, sq_head may be equal to sq_tail.
-  if (ctx->sq_head > ctx->sq_tail) {
-    // Copy socket from the queue and increment tail
-    *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
-    ctx->sq_tail++;
-    DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+// Lock-free pop. Returns 0 if the cell at the tail is still being produced.
+static int sq_pop(struct mg_context *ctx, struct socket *sp) {
+  struct sq_cell *cell;
+  int64_t wait, max;
+  unsigned pos;
+  int dif;
 
-    // Wrap pointers if needed
-    while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-      ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-      ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+  for (;;) {
+    pos = ctx->sq_tail;
+    cell = &ctx->queue[pos & ctx->sq_mask];
+    mg_barrier();
+    dif = (int) (cell->seq - (pos + 1));
+    if (dif == 0 && mg_cas(&ctx->sq_tail, pos, pos + 1)) {
+      break;
+    } else if (dif < 0) {
+      return 0;
     }
   }
+  *sp = cell->so;
+  wait = mg_clock_ns() - cell->enqueued;
+  sp->queued_ns = wait;
+  mg_barrier();
+  cell->seq = pos + ctx->sq_mask + 1;
 
-  (void) pthread_cond_signal(&ctx->sq_empty);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  mg_add64(&ctx->sq_count, 1);
+  mg_add64(&ctx->sq_wait_ns, wait);
+  while ((max = ctx->sq_wait_max) < wait &&
+         !mg_cas64(&ctx->sq_wait_max, max, wait)) {
+  }
+  return 1;
+}
+
+// Worker threads take accepted socket from the queue
+static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+  DEBUG_TRACE(("going idle"));
+  while (sem_wait(&ctx->sq_items) != 0) {
+  }
+  if (ctx->stop_flag != 0) {
+    return 0;
+  }
+
+  // The semaphore guarantees an item; its producer may still be writing it
+  while (!sq_pop(ctx, sp)) {
+    sched_yield();
+  }
+  (void) sem_post(&ctx->sq_slots);
+  DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+  MG_PROBE2(dequeue, (int) sp->sock, (long long) sp->queued_ns);
 
-  return !ctx->stop_flag;
+  return 1;
 }
 
 static void *worker_thread(void *thread_func_param) {
@@ -4881,8 +5238,6 @@ static void *worker_thread(void *thread_func_param) {
     conn->ctx = ctx;
     conn->request_info.user_data = ctx->user_data;
 
-    // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
-    // sq_empty condvar to wake up the master waiting in produce_socket()
     while (consume_socket(ctx, &conn->client)) {
       conn->birth_time = time(NULL);
 
@@ -4920,25 +5275,48 @@ static void *worker_thread(void *thread_func_param) {
   return NULL;
 }
 
-// Master thread adds accepted socket to a queue
-static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
+// Queue a socket into a slot already taken from sq_slots
+static void push_socket(struct mg_context *ctx, const struct socket *sp) {
+  while (!sq_push(ctx, sp)) {
+    sched_yield();
+  }
+  (void) sem_post(&ctx->sq_items);
+  DEBUG_TRACE(("queued socket %d", sp->sock));
+}
 
-  // If the queue is full, wait
-  while (ctx->stop_flag == 0 &&
-         ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-    (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
+// The poll() loop adds accepted sockets to the queue. If the queue stays
+// full, it stops accepting and the kernel backlog absorbs the rest.
+static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
+  while (!sem_wait_ms(&ctx->sq_slots, 200)) {
+    if (ctx->stop_flag != 0) {
+      closesocket(sp->sock);
+      return;
+    }
   }
+  push_socket(ctx, sp);
+}
 
-  if (ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue)) {
-    // Copy socket to the queue and increment head
-    ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-    ctx->sq_head++;
-    DEBUG_TRACE(("queued socket %d", sp->sock));
+void mg_get_queue_stats(struct mg_context *ctx, struct mg_queue_stats *st) {
+#if defined(USE_EPOLL)
+  int i;
+#endif
+
+  memset(st, 0, sizeof(*st));
+  st->accepted = ctx->sq_count;
+  st->wait_ns = ctx->sq_wait_ns;
+  st->max_wait_ns = ctx->sq_wait_max;
+  st->depth = (int) (ctx->sq_head - ctx->sq_tail);
+  st->capacity = atoi(ctx->config[QUEUE_DEPTH]);
+#if defined(USE_EPOLL)
+  st->acceptors = ctx->num_acceptors;
+  for (i = 0; i < ctx->num_acceptors; i++) {
+    st->parked += ctx->acceptors[i].num_parked;
   }
+#endif
+}
 
-  (void) pthread_cond_signal(&ctx->sq_full);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+long long mg_get_queue_wait(const struct mg_connection *conn) {
+  return conn->client.queued_ns;
 }
 
 static int set_sock_timeout(SOCKET sock, int milliseconds) {
@@ -4953,35 +5331,287 @@ static int set_sock_timeout(SOCKET sock, int milliseconds) {
     setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &t, sizeof(t));
 }
 
-static void accept_new_connection(const struct socket *listener,
-                                  struct mg_context *ctx) {
-  struct socket so;
+// Check a new socket against the ACL and set its options. Returns 0 if it
+// was refused and closed.
+static int set_up_accepted(struct mg_context *ctx,
+                           const struct socket *listener, struct socket *so) {
   char src_addr[20];
-  socklen_t len = sizeof(so.rsa);
+  socklen_t len = sizeof(so->lsa);
   int on = 1;
 
-  if ((so.sock = accept(listener->sock, &so.rsa.sa, &len)) == INVALID_SOCKET) {
-  } else if (!check_acl(ctx, ntohl(* (uint32_t *) &so.rsa.sin.sin_addr))) {
-    sockaddr_to_string(src_addr, sizeof(src_addr), &so.rsa);
+  if (!check_acl(ctx, ntohl(* (uint32_t *) &so->rsa.sin.sin_addr))) {
+    sockaddr_to_string(src_addr, sizeof(src_addr), &so->rsa);
     cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
-    closesocket(so.sock);
+    closesocket(so->sock);
+    return 0;
   } else {
-    // Put so socket structure into the queue
-    DEBUG_TRACE(("Accepted socket %d", (int) so.sock));
-    so.is_ssl = listener->is_ssl;
-    so.ssl_redir = listener->ssl_redir;
-    getsockname(so.sock, &so.lsa.sa, &len);
+    DEBUG_TRACE(("Accepted socket %d", (int) so->sock));
+    MG_PROBE1(accept, (int) so->sock);
+    so->is_ssl = listener->is_ssl;
+    so->ssl_redir = listener->ssl_redir;
+    getsockname(so->sock, &so->lsa.sa, &len);
     // Set TCP keep-alive. This is needed because if HTTP-level keep-alive
     // is enabled, and client resets the connection, server won't get
     // TCP FIN or RST and will keep the connection open forever. With TCP
     // keep-alive, next keep-alive handshake will figure out that the client
     // is down and will close the server end.
     // Thanks to Igor Klopov who suggested the patch.
-    setsockopt(so.sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on, sizeof(on));
-    set_sock_timeout(so.sock, atoi(ctx->config[REQUEST_TIMEOUT]));
-    produce_socket(ctx, &so);
+    setsockopt(so->sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on, sizeof(on));
+    set_sock_timeout(so->sock, atoi(ctx->config[REQUEST_TIMEOUT]));
+    return 1;
+  }
+}
+
+static void queue_accepted(struct mg_context *ctx,
+                           const struct socket *listener, struct socket *so) {
+  if (set_up_accepted(ctx, listener, so)) {
+    produce_socket(ctx, so);
+  }
+}
+
+static void accept_new_connection(const struct socket *listener,
+                                  struct mg_context *ctx) {
+  struct socket so;
+  socklen_t len = sizeof(so.rsa);
+
+  if ((so.sock = accept(listener->sock, &so.rsa.sa, &len)) != INVALID_SOCKET) {
+    queue_accepted(ctx, listener, &so);
+  }
+}
+
+#if defined(USE_EPOLL)
+// Edge-triggered: accept in batches until accept4() says EAGAIN, as the
+// listener won't fire again for connections already in the backlog. New
+// sockets wait in the reactor, like parked ones, until their first
+// request is readable, so no worker blocks on a client that has yet to
+// send anything. Returns 0 if accept4() stopped short of draining the
+// backlog, out of descriptors or otherwise, so the reactor retries on
+// its next tick.
+static int accept_batch(struct acceptor *acc,
+                        const struct socket *listener) {
+  struct mg_context *ctx = acc->ctx;
+  struct socket batch[32];
+  socklen_t len;
+  int i, n, err = 0;
+
+  do {
+    for (n = 0; n < (int) ARRAY_SIZE(batch);) {
+      len = sizeof(batch[n].rsa);
+      if ((batch[n].sock = accept4(listener->sock, &batch[n].rsa.sa, &len,
+                                   SOCK_CLOEXEC)) != INVALID_SOCKET) {
+        n++;
+      } else if ((err = ERRNO) != EINTR && err != ECONNABORTED) {
+        break;
+      }
+    }
+    for (i = 0; i < n; i++) {
+      if (!set_up_accepted(ctx, listener, &batch[i]) ||
+          park_socket(acc, &batch[i])) {
+        continue;
+      }
+      // Never wait for a slot here: the reactor would stop with it
+      if (sem_wait_ms(&ctx->sq_slots, 0)) {
+        push_socket(ctx, &batch[i]);
+      } else {
+        closesocket(batch[i].sock);
+      }
+    }
+  } while (n == (int) ARRAY_SIZE(batch) && ctx->stop_flag == 0);
+
+  return n == (int) ARRAY_SIZE(batch) || err == EAGAIN || err == EWOULDBLOCK;
+}
+
+static void close_parked(struct acceptor *acc, struct parked *p) {
+  (void) epoll_ctl(acc->epoll_fd, EPOLL_CTL_DEL, p->so.sock, NULL);
+  closesocket(p->so.sock);
+  free(p);
+}
+
+static void arm_listeners(struct acceptor *acc, int on) {
+  struct epoll_event ev;
+  int i;
+
+  for (i = 0; i < acc->num_listeners; i++) {
+    ev.events = on ? EPOLLIN | EPOLLET : 0;
+    ev.data.ptr = &acc->listeners[i];
+    (void) epoll_ctl(acc->epoll_fd, EPOLL_CTL_MOD, acc->listeners[i].sock, &ev);
+  }
+  acc->listening = on;
+  acc->accept_retry = 0;
+}
+
+// Queue readable sockets while there are free slots, without waiting for
+// one. Those left stay registered, disarmed by EPOLLONESHOT, and so do the
+// listeners, until a worker frees a slot; re-arming a listener reports
+// whatever is in its backlog by then.
+static void flush_ready(struct acceptor *acc) {
+  struct mg_context *ctx = acc->ctx;
+  struct parked *p;
+
+  while ((p = acc->ready) != NULL && sem_wait_ms(&ctx->sq_slots, 0)) {
+    acc->ready = p->next;
+    (void) epoll_ctl(acc->epoll_fd, EPOLL_CTL_DEL, p->so.sock, NULL);
+    push_socket(ctx, &p->so);
+    free(p);
+  }
+  if (acc->ready == NULL) {
+    acc->ready_tail = NULL;
+  }
+
+  if (acc->ready != NULL && acc->listening) {
+    arm_listeners(acc, 0);
+  } else if (acc->ready == NULL && !acc->listening) {
+    arm_listeners(acc, 1);
+  }
+}
+
+// Edge-triggered reactor: accepts new connections and holds them, and idle
+// keep-alive sockets, without a thread each. Only sockets with a request ready to read
+// are queued to the workers.
+static void reactor_loop(struct acceptor *acc) {
+  struct mg_context *ctx = acc->ctx;
+  struct epoll_event ev[64];
+  struct socket *ls = acc->listeners;
+  struct parked *p;
+  int i, n, idle = atoi(ctx->config[REQUEST_TIMEOUT]) / 1000;
+  time_t now;
+
+  for (i = 0; i < acc->num_listeners; i++) {
+    set_non_blocking_mode(ls[i].sock);
+    ev[0].events = EPOLLIN | EPOLLET;
+    ev[0].data.ptr = &ls[i];
+    if (epoll_ctl(acc->epoll_fd, EPOLL_CTL_ADD, ls[i].sock, &ev[0]) != 0) {
+      cry(fc(ctx), "%s: epoll_ctl: %s", __func__, strerror(ERRNO));
+    }
+  }
+  acc->listening = 1;
+
+  while (ctx->stop_flag == 0) {
+    n = epoll_wait(acc->epoll_fd, ev, (int) ARRAY_SIZE(ev),
+                   acc->ready != NULL || acc->accept_retry ? 10 : 200);
+    if (acc->accept_retry) {
+      acc->accept_retry = 0;
+      for (i = 0; i < acc->num_listeners; i++) {
+        acc->accept_retry |= !accept_batch(acc, &ls[i]);
+      }
+    }
+
+    for (i = 0; i < n && ctx->stop_flag == 0; i++) {
+      if ((struct socket *) ev[i].data.ptr >= ls &&
+          (struct socket *) ev[i].data.ptr < ls + acc->num_listeners) {
+        acc->accept_retry |= !accept_batch(acc, ev[i].data.ptr);
+        continue;
+      }
+
+      p = (struct parked *) ev[i].data.ptr;
+      (void) pthread_mutex_lock(&acc->mutex);
+      unlink_parked(acc, p);
+      (void) pthread_mutex_unlock(&acc->mutex);
+      if (ev[i].events & EPOLLIN) {
+        p->next = NULL;
+        if (acc->ready_tail != NULL) acc->ready_tail->next = p;
+        else acc->ready = p;
+        acc->ready_tail = p;
+      } else {
+        close_parked(acc, p);
+      }
+    }
+    flush_ready(acc);
+
+    // Drop keep-alive sockets idle for longer than the request timeout
+    now = time(NULL);
+    (void) pthread_mutex_lock(&acc->mutex);
+    while ((p = acc->parked) != NULL && now - p->since > idle) {
+      unlink_parked(acc, p);
+      close_parked(acc, p);
+    }
+    (void) pthread_mutex_unlock(&acc->mutex);
+  }
+}
+
+static void *acceptor_thread(void *param) {
+  struct acceptor *acc = (struct acceptor *) param;
+  struct mg_context *ctx = acc->ctx;
+
+  reactor_loop(acc);
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  ctx->num_acceptors_running--;
+  (void) pthread_cond_signal(&ctx->cond);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  return NULL;
+}
+
+// Open another listening socket on the same address as orig.
+static int clone_listener(const struct socket *orig, struct socket *so) {
+  socklen_t len = sizeof(so->lsa);
+  int on = 1;
+
+  *so = *orig;
+  if (getsockname(orig->sock, &so->lsa.sa, &len) != 0 ||
+      (so->sock = socket(so->lsa.sa.sa_family, SOCK_STREAM, 6)) ==
+      INVALID_SOCKET) {
+    return 0;
+  }
+  if (setsockopt(so->sock, SOL_SOCKET, SO_REUSEADDR,
+                 (void *) &on, sizeof(on)) != 0 ||
+      setsockopt(so->sock, SOL_SOCKET, SO_REUSEPORT,
+                 (void *) &on, sizeof(on)) != 0 ||
+      bind(so->sock, &so->lsa.sa, len) != 0 ||
+      listen(so->sock, SOMAXCONN) != 0) {
+    closesocket(so->sock);
+    return 0;
+  }
+  set_close_on_exec(so->sock);
+  return 1;
+}
+
+// Give every acceptor its own SO_REUSEPORT copy of each listening socket,
+// so the kernel spreads incoming connections across them. Falls back to
+// fewer acceptors (zero means the poll() loop) when that is not possible.
+static int set_acceptors(struct mg_context *ctx) {
+  struct acceptor *acc;
+  struct socket *ls;
+  int i, j, n = atoi(ctx->config[ACCEPT_THREADS]);
+  int nports = ctx->num_listening_sockets;
+
+  if (n <= 0) {
+    n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (n <= 0 || nports == 0 ||
+      (ls = (struct socket *) realloc(ctx->listening_sockets,
+                                      n * nports * sizeof(ls[0]))) == NULL ||
+      (ctx->acceptors = (struct acceptor *) calloc(n, sizeof(*acc))) == NULL) {
+    return 1;
+  }
+  ctx->listening_sockets = ls;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < nports; j++) {
+      if (i > 0 && !clone_listener(&ls[j], &ls[i * nports + j])) {
+        break;
+      }
+    }
+    acc = &ctx->acceptors[i];
+    if (j < nports ||
+        (acc->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      cry(fc(ctx), "%s: using %d acceptor(s): %s", __func__, i,
+          strerror(ERRNO));
+      while (i > 0 && j-- > 0) {
+        closesocket(ls[i * nports + j].sock);
+      }
+      break;
+    }
+    acc->ctx = ctx;
+    acc->listeners = &ls[i * nports];
+    acc->num_listeners = nports;
+    (void) pthread_mutex_init(&acc->mutex, NULL);
+    ctx->num_listening_sockets = (i + 1) * nports;
+    ctx->num_acceptors++;
   }
+  return 1;
 }
+#endif // USE_EPOLL
 
 static void *master_thread(void *thread_func_param) {
   struct mg_context *ctx = thread_func_param;
@@ -4999,6 +5629,22 @@ static void *master_thread(void *thread_func_param) {
   pthread_setschedparam(pthread_self(), SCHED_RR, &sched_param);
 #endif
 
+#if defined(USE_EPOLL)
+  if (ctx->num_acceptors > 0) {
+    // This thread is acceptor 0
+    for (i = 1; i < ctx->num_acceptors; i++) {
+      if (mg_start_thread(acceptor_thread, &ctx->acceptors[i]) != 0) {
+        cry(fc(ctx), "Cannot start acceptor thread: %d", ERRNO);
+      } else {
+        (void) pthread_mutex_lock(&ctx->mutex);
+        ctx->num_acceptors_running++;
+        (void) pthread_mutex_unlock(&ctx->mutex);
+      }
+    }
+    reactor_loop(&ctx->acceptors[0]);
+  }
+#endif
+
   pfd = calloc(ctx->num_listening_sockets, sizeof(pfd[0]));
   while (ctx->stop_flag == 0) {
     for (i = 0; i < ctx->num_listening_sockets; i++) {
@@ -5017,11 +5663,22 @@ static void *master_thread(void *thread_func_param) {
   free(pfd);
   DEBUG_TRACE(("stopping workers"));
 
+#if defined(USE_EPOLL)
+  (void) pthread_mutex_lock(&ctx->mutex);
+  while (ctx->num_acceptors_running > 0) {
+    (void) pthread_cond_wait(&ctx->cond, &ctx->mutex);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+#endif
+
   // Stop signal received: somebody called mg_stop. Quit.
   close_all_listening_sockets(ctx);
 
-  // Wakeup workers that are waiting for connections to handle.
-  pthread_cond_broadcast(&ctx->sq_full);
+  // Wakeup workers that are waiting for connections to handle. Workers
+  // exit as they wake, so count them before posting.
+  for (i = ctx->num_threads; i > 0; i--) {
+    (void) sem_post(&ctx->sq_items);
+  }
 
   // Wait until all threads finish
   (void) pthread_mutex_lock(&ctx->mutex);
@@ -5030,11 +5687,30 @@ static void *master_thread(void *thread_func_param) {
   }
   (void) pthread_mutex_unlock(&ctx->mutex);
 
-  // All threads exited, no sync is needed. Destroy mutex and condvars
+  // All threads exited, no sync is needed. Close what is left in the
+  // queue and the reactors, destroy mutexes and semaphores.
+  while (ctx->sq_head != ctx->sq_tail) {
+    closesocket(ctx->queue[ctx->sq_tail++ & ctx->sq_mask].so.sock);
+  }
+#if defined(USE_EPOLL)
+  for (i = 0; i < ctx->num_acceptors; i++) {
+    struct acceptor *acc = &ctx->acceptors[i];
+    while (acc->parked != NULL) {
+      struct parked *p = acc->parked;
+      unlink_parked(acc, p);
+      close_parked(acc, p);
+    }
+    while (acc->ready != NULL) {
+      struct parked *p = acc->ready;
+      acc->ready = p->next;
+      close_parked(acc, p);
+    }
+  }
+#endif
   (void) pthread_mutex_destroy(&ctx->mutex);
   (void) pthread_cond_destroy(&ctx->cond);
-  (void) pthread_cond_destroy(&ctx->sq_empty);
-  (void) pthread_cond_destroy(&ctx->sq_full);
+  (void) sem_destroy(&ctx->sq_items);
+  (void) sem_destroy(&ctx->sq_slots);
 
 #if !defined(NO_SSL)
   uninitialize_ssl(ctx);
@@ -5068,6 +5744,15 @@ static void free_context(struct mg_context *ctx) {
   }
 #endif // !NO_SSL
 
+  free(ctx->queue);
+#if defined(USE_EPOLL)
+  for (i = 0; i < ctx->num_acceptors; i++) {
+    (void) close(ctx->acceptors[i].epoll_fd);
+    (void) pthread_mutex_destroy(&ctx->acceptors[i].mutex);
+  }
+  free(ctx->acceptors);
+#endif
+
   // Deallocate context itself
   free(ctx);
 }
@@ -5143,6 +5828,10 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
       !set_ssl_option(ctx) ||
 #endif
       !set_ports_option(ctx) ||
+      !sq_init(ctx) ||
+#if defined(USE_EPOLL)
+      !set_acceptors(ctx) ||
+#endif
 #if !defined(_WIN32)
       !set_uid_option(ctx) ||
 #endif
@@ -5161,8 +5850,6 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
 
   (void) pthread_mutex_init(&ctx->mutex, NULL);
   (void) pthread_cond_init(&ctx->cond, NULL);
-  (void) pthread_cond_init(&ctx->sq_empty, NULL);
-  (void) pthread_cond_init(&ctx->sq_full, NULL);
 
   // Start master (listening) thread
   mg_start_thread(master_thread, ctx);
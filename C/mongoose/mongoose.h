@@ -183,10 +183,36 @@ int mg_printf(struct mg_connection *,
 void mg_send_file(struct mg_connection *conn, const char *path);
 
 
+// Send len bytes of an open file, starting at offset, as (part of) a body
+// whose headers were already sent. Uses sendfile() where it can.
+// Return number of bytes sent.
+long long mg_send_fd(struct mg_connection *conn, int fd, long long offset,
+                     long long len);
+
+
 // Read data from the remote end, return number of bytes read.
 int mg_read(struct mg_connection *, void *buf, size_t len);
 
 
+// Accept queue statistics, filled in by mg_get_queue_stats().
+struct mg_queue_stats {
+  long long accepted;     // Sockets handed from acceptors to workers
+  long long wait_ns;      // Total time those sockets spent queued
+  long long max_wait_ns;  // Longest time a single socket spent queued
+  int depth;              // Sockets queued right now
+  int capacity;           // Configured queue_depth
+  int acceptors;          // Acceptor threads, 0 when using poll()
+  int parked;             // Idle keep-alive sockets held by acceptors
+};
+
+void mg_get_queue_stats(struct mg_context *ctx, struct mg_queue_stats *stats);
+
+
+// Return nanoseconds the connection waited in the accept queue before a
+// worker picked it up, for the first request after that; 0 for the rest.
+long long mg_get_queue_wait(const struct mg_connection *conn);
+
+
 // Get the value of particular HTTP header.
 //
 // This is a helper function. It traverses request_info->http_headers array,